@@ -0,0 +1,389 @@
+/*
+Microbenchmarks for the code running in the event loop.
+
+Usage: microbench [--filter SUBSTRING] [--save FILE] [--baseline FILE] [--threshold PERCENT]
+
+Exits with 1 on a regression, see below. Checks of behavior rather than speed live
+in tests/checks.cpp.
+
+Every result is printed to stdout as one JSON object per line:
+	{"name": "...", "ns_per_op": 12.3, "ops": 1000000}
+--save also writes them to FILE. --baseline reads a file written by --save, prints
+the comparison to stderr and exits with 1 if anything got slower than the threshold
+(10% by default).
+*/
+#include "queue.hpp"
+#include "substring_matcher.hpp"
+#include "path_table.hpp"
+#include "lru_cache.hpp"
+#include "statistics.hpp"
+#include "usage_log.hpp"
+#include "window_watcher.hpp"
+#include "trace.hpp"
+#include "metrics.hpp"
+#include "process_killer.hpp"
+#include "resource_sampler.hpp"
+#include "usage_report.hpp"
+#include "fixtures.hpp"
+#include <functional>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct result {
+	std::string name;
+	double ns_per_op;
+	uint64_t ops;
+};
+
+static std::vector<result> results;
+static std::string filter;
+
+// does nothing with the results, but the compiler doesn't know that
+static volatile uint64_t sink;
+
+/*
+Calls f() (which performs `ops` operations and returns their wall time) until at least
+min_time has been spent, and records the best time per operation among the runs.
+*/
+static void bench(const std::string & name, uint64_t ops, std::function<bench_clock::duration()> f) {
+	if (name.find(filter) == std::string::npos) return;
+	const bench_clock::duration min_time = std::chrono::milliseconds(300);
+	bench_clock::duration spent = bench_clock::duration::zero(), best = bench_clock::duration::max();
+	uint64_t total_ops = 0;
+	for (int runs = 0; runs < 3 || spent < min_time; runs++) {
+		bench_clock::duration t = f();
+		spent += t;
+		total_ops += ops;
+		if (t < best) best = t;
+	}
+	result r {name, std::chrono::duration<double,std::nano>(best).count() / ops, total_ops};
+	results.push_back(r);
+	std::cout << "{\"name\": \"" << r.name << "\", \"ns_per_op\": " << r.ns_per_op << ", \"ops\": " << r.ops << "}" << std::endl;
+}
+
+// times a simple loop body
+static std::function<bench_clock::duration()> loop(uint64_t ops, std::function<void(uint64_t)> body) {
+	return [ops, body]() {
+		bench_clock::time_point start = bench_clock::now();
+		for (uint64_t i = 0; i < ops; i++) body(i);
+		return bench_clock::now() - start;
+	};
+}
+
+template <typename Q>
+static bench_clock::duration queue_transfer(unsigned producers, uint64_t ops, bool batch) {
+	Q q;
+	bench_clock::time_point start = bench_clock::now();
+	std::vector<std::thread> threads;
+	for (unsigned p = 0; p < producers; p++)
+		threads.emplace_back([&q, ops, producers]() {
+			for (uint64_t i = 0; i < ops / producers; i++) q.push(i);
+		});
+	uint64_t received = 0, sum = 0;
+	while (received < ops / producers * producers) {
+		if (batch) {
+			received += q.pop_all([&sum](uint64_t && x) { sum += x; });
+		} else {
+			sum += q.pop();
+			received++;
+		}
+	}
+	bench_clock::duration t = bench_clock::now() - start;
+	for (std::thread & th : threads) th.join();
+	sink = sum;
+	return t;
+}
+
+static void queue_benches() {
+	const uint64_t ops = 1000000;
+	bench("thr_queue/1p1c/pop", ops, [ops]() { return queue_transfer<thr_queue<uint64_t>>(1, ops, false); });
+	bench("thr_queue/1p1c/pop_all", ops, [ops]() { return queue_transfer<thr_queue<uint64_t>>(1, ops, true); });
+	bench("thr_queue/4p1c/pop", ops, [ops]() { return queue_transfer<thr_queue<uint64_t>>(4, ops, false); });
+	bench("spsc_queue/1p1c/pop", ops, [ops]() { return queue_transfer<spsc_queue<uint64_t>>(1, ops, false); });
+	bench("spsc_queue/1p1c/pop_all", ops, [ops]() { return queue_transfer<spsc_queue<uint64_t>>(1, ops, true); });
+}
+
+/*
+Kills a bunch of our own children at once, half of them ignoring SIGTERM, so the
+time per kill is mostly the grace period shared by all of them.
+*/
+static void killer_benches() {
+	const uint64_t children = 32;
+	bench("ProcessKiller/kill/32", children, [children]() {
+		std::vector<pid_t> pids;
+		for (uint64_t i = 0; i < children; i++) {
+			pid_t pid = fork();
+			if (pid < 0) throw std::runtime_error("fork returned error");
+			if (!pid) {
+				if (i % 2) signal(SIGTERM, SIG_IGN);
+				for (;;) pause();
+			}
+			pids.push_back(pid);
+		}
+		ProcessKiller killer(ProcessKiller::Policy(std::chrono::milliseconds(20)));
+		bench_clock::time_point start = bench_clock::now();
+		for (pid_t pid : pids)
+			killer.kill(pid, process_start_time(pid), [](pid_t, ProcessKiller::Outcome) {});
+		while (killer.pending()) std::this_thread::sleep_for(std::chrono::microseconds(100));
+		bench_clock::duration t = bench_clock::now() - start;
+		for (pid_t pid : pids) waitpid(pid, nullptr, 0);
+		return t;
+	});
+}
+
+// focus going back and forth between two processes, so every boundary reads both
+static void sampler_benches() {
+	const uint64_t ops = 20000;
+	pid_t child = fork();
+	if (child < 0) throw std::runtime_error("fork returned error");
+	if (!child) {
+		for (;;) pause();
+	}
+	pid_t pids[] = {getpid(), child};
+	ResourceSampler sampler;
+	bench("ResourceSampler/boundary", ops, loop(ops, [&](uint64_t i) {
+		resource_usage used = sampler.boundary(0, pids[i % 2]);
+		sink += used.rss;
+	}));
+	kill(child, SIGKILL);
+	waitpid(child, nullptr, 0);
+}
+
+// instrumentation is always on, so it has to stay cheap
+static void metrics_benches() {
+	const uint64_t ops = 10000000;
+	static latency_histogram h;
+	bench("latency_histogram/record", ops, loop(ops, [](uint64_t i) { h.record(std::chrono::nanoseconds(i * 7919 % 1000000)); }));
+	bench("latency_histogram/timed", ops, loop(ops, [](uint64_t) { latency_histogram::timed t(h); }));
+}
+
+static std::string random_word(std::mt19937 & rng, size_t min_len, size_t max_len) {
+	static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-.";
+	std::string ret;
+	for (size_t len = min_len + rng() % (max_len - min_len + 1); len; len--)
+		ret += alphabet[rng() % (sizeof alphabet - 1)];
+	return ret;
+}
+
+static void matcher_benches() {
+	std::mt19937 rng(42);
+	const size_t rule_count = 5000;
+	std::list<std::string> rules;
+	for (size_t i = 0; i < rule_count; i++)
+		rules.push_back(random_word(rng, 6, 20));
+	std::vector<std::string> titles;
+	for (int i = 0; i < 64; i++)
+		titles.push_back(random_word(rng, 5, 15) + " - " + random_word(rng, 10, 40) + " \xe2\x80\x94 Mozilla Firefox");
+	const uint64_t ops = 100000;
+	SubstringMatcher exact(rules), ascii(rules, SubstringMatcher::Mode::ascii_case_insensitive),
+		utf8(rules, SubstringMatcher::Mode::utf8_case_insensitive);
+	bench("SubstringMatcher/exact/5k", ops, loop(ops, [&](uint64_t i) { sink += exact.search(titles[i % titles.size()]); }));
+	bench("SubstringMatcher/ascii_ci/5k", ops, loop(ops, [&](uint64_t i) { sink += ascii.search(titles[i % titles.size()]); }));
+	bench("SubstringMatcher/utf8_ci/5k", ops, loop(ops, [&](uint64_t i) { sink += utf8.search(titles[i % titles.size()]); }));
+
+	std::vector<std::string> paths;
+	PathIdSet whitelist;
+	for (size_t i = 0; i < 100000; i++) {
+		paths.push_back("/usr/bin/" + random_word(rng, 4, 16));
+		if (i % 2) whitelist.insert(PathTable::global().intern(paths.back()));
+	}
+	std::vector<path_id> ids;
+	for (size_t i = 0; i < 1024; i++)
+		ids.push_back(PathTable::global().intern(paths[rng() % paths.size()]));
+	bench("PathIdSet/contains/100k", ops * 10, loop(ops * 10, [&](uint64_t i) { sink += whitelist.contains(ids[i % ids.size()]); }));
+	bench("PathTable/find/100k", ops, loop(ops, [&](uint64_t i) { sink += PathTable::global().find(paths[(i * 7919) % paths.size()]); }));
+
+	lru_cache<uint32_t,uint32_t> cache(256);
+	for (uint32_t i = 0; i < 256; i++) cache.insert(i, i);
+	bench("lru_cache/find/256", ops * 10, loop(ops * 10, [&](uint64_t i) { sink += *cache.find(i % 16); }));
+}
+
+static void statistics_benches() {
+	std::mt19937 rng(42);
+	std::vector<std::string> programs, titles;
+	for (int i = 0; i < 16; i++) programs.push_back("/usr/bin/" + random_word(rng, 4, 10));
+	for (int i = 0; i < 256; i++) titles.push_back(random_word(rng, 10, 60));
+	const uint64_t ops = 200000;
+	null_buf nb;
+	std::ostream null_out(&nb);
+	bench("Statistics/add_interval", ops, [&]() {
+		Statistics stat(null_out);
+		bench_clock::time_point start = bench_clock::now();
+		for (uint64_t i = 0; i < ops; i++)
+			stat.add_program_usage_interval(programs[i % programs.size()], titles[i % titles.size()], std::chrono::milliseconds(i), ProgramRole::grey);
+		return bench_clock::now() - start;
+	});
+}
+
+/*
+Batch reports aren't in the event loop, but they should scale with cores: compare
+the single-threaded run with the one using every core.
+*/
+static void report_benches() {
+	std::mt19937 rng(42);
+	std::vector<std::string> programs;
+	for (int i = 0; i < 64; i++) programs.push_back("/usr/bin/" + random_word(rng, 4, 10));
+	const size_t logs = 8, records = 100000;
+	std::vector<std::string> paths;
+	for (size_t l = 0; l < logs; l++) {
+		paths.push_back("/tmp/microbench-" + std::to_string(getpid()) + "-" + std::to_string(l) + ".log");
+		UsageLog log(paths.back());
+		std::chrono::system_clock::time_point t = std::chrono::system_clock::now() - std::chrono::hours(24 * 90);
+		for (size_t i = 0; i < records; i++, t += std::chrono::seconds(60))
+			log.append(t, std::chrono::seconds(rng() % 60), programs[rng() % programs.size()], "", ProgramRole(rng() % 3));
+	}
+	unsigned cores = std::max(std::thread::hardware_concurrency(), 1u);
+	for (unsigned threads : {1u, cores}) {
+		UsageReport report;
+		report.set_threads(threads);
+		report.set_chunk_records(1 << 14);
+		bench("UsageReport/800k/" + std::to_string(threads) + "_threads", logs * records, [&]() {
+			bench_clock::time_point start = bench_clock::now();
+			sink += report.run(paths).size();
+			return bench_clock::now() - start;
+		});
+		if (threads == cores) break;
+	}
+	for (const std::string & path : paths) {
+		remove(path.c_str());
+		remove((path + ".strings").c_str());
+	}
+}
+
+// some rules looking at titles, so that classification can't ignore them
+static ProgramClassifier::rules bench_rules() {
+	ProgramClassifier::rules rules;
+	rules.emplace_back(new WindowTitleSubstringList(ProgramRole::black, {"13", "57"}));
+	rules.emplace_back(new ProgramPathSet(ProgramRole::white, {"/usr/bin/stterm"}));
+	return rules;
+}
+
+// the whole event loop, fed by the replay backend as fast as it can go
+static void window_watcher_benches() {
+	std::string path = "/tmp/microbench-" + std::to_string(getpid()) + ".trace";
+	ReplaySource source {path, ReplaySource::Speed::fast};
+	null_buf nb;
+	std::ostream null_out(&nb);
+
+	const uint64_t events = 100000;
+	write_cycling_trace(path, events);
+	bench("WindowWatcher/replay/100k", events, [&]() {
+		Statistics stat(null_out);
+		WindowWatcher ww(stat, source);
+		ww.set_rules(bench_rules());
+		bench_clock::time_point start = bench_clock::now();
+		ww.run();
+		return bench_clock::now() - start;
+	});
+	bench("WindowWatcher/replay_reactor/100k", events, [&]() {
+		Statistics stat(null_out);
+		WindowWatcher ww(stat, source);
+		ww.set_rules(bench_rules());
+		Reactor reactor;
+		bench_clock::time_point start = bench_clock::now();
+		ww.run(reactor);
+		return bench_clock::now() - start;
+	});
+	// rules replaced from another thread all along, like a rule file being saved over and over
+	bench("WindowWatcher/replay_reloading/100k", events, [&]() {
+		Statistics stat(null_out);
+		WindowWatcher ww(stat, source);
+		ww.set_rules(bench_rules());
+		std::atomic<bool> done(false);
+		std::thread reloader([&]() {
+			while (!done) {
+				ww.set_rules(bench_rules());
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		});
+		bench_clock::time_point start = bench_clock::now();
+		ww.run();
+		bench_clock::duration ret = bench_clock::now() - start;
+		done = true;
+		reloader.join();
+		return ret;
+	});
+	remove(path.c_str());
+}
+
+static std::map<std::string,double> read_results(const std::string & file) {
+	std::ifstream in(file);
+	if (!in) throw std::runtime_error("can't open " + file);
+	std::map<std::string,double> ret;
+	std::string line;
+	while (std::getline(in, line)) {
+		// we only ever read our own output, so there's no need for a real JSON parser
+		size_t name = line.find("\"name\": \""), value = line.find("\"ns_per_op\": ");
+		if (name == std::string::npos || value == std::string::npos) continue;
+		name += strlen("\"name\": \"");
+		ret[line.substr(name, line.find('"', name) - name)] = strtod(line.c_str() + value + strlen("\"ns_per_op\": "), nullptr);
+	}
+	return ret;
+}
+
+int main(int argc, char ** argv) try {
+	std::string save, baseline;
+	double threshold = 10;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (i + 1 < argc && arg == "--filter") filter = argv[++i];
+		else if (i + 1 < argc && arg == "--save") save = argv[++i];
+		else if (i + 1 < argc && arg == "--baseline") baseline = argv[++i];
+		else if (i + 1 < argc && arg == "--threshold") threshold = atof(argv[++i]);
+		else {
+			std::cerr << "Usage: " << argv[0] << " [--filter SUBSTRING] [--save FILE] [--baseline FILE] [--threshold PERCENT]" << std::endl;
+			return 2;
+		}
+	}
+
+	queue_benches();
+	killer_benches();
+	sampler_benches();
+	metrics_benches();
+	matcher_benches();
+	statistics_benches();
+	report_benches();
+	window_watcher_benches();
+
+	int ret = 0;
+	if (!save.empty()) {
+		std::ofstream out(save);
+		for (const result & r : results)
+			out << "{\"name\": \"" << r.name << "\", \"ns_per_op\": " << r.ns_per_op << ", \"ops\": " << r.ops << "}\n";
+	}
+
+	if (!baseline.empty()) {
+		std::map<std::string,double> old = read_results(baseline);
+		for (const result & r : results) {
+			auto it = old.find(r.name);
+			if (it == old.end()) continue;
+			double change = (r.ns_per_op / it->second - 1) * 100;
+			bool regressed = change > threshold;
+			if (regressed) ret = 1;
+			std::cerr << std::left << std::setw(32) << r.name << std::right << std::fixed << std::setprecision(1)
+				<< std::setw(12) << it->second << " -> " << std::setw(12) << r.ns_per_op << " ns/op "
+				<< std::showpos << std::setw(7) << change << std::noshowpos << "%"
+				<< (regressed ? "  REGRESSION" : "") << std::endl;
+		}
+	}
+	return ret;
+} catch (std::exception & e) {
+	std::cerr << e.what() << std::endl;
+	return 2;
+}
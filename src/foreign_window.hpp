@@ -1,8 +1,13 @@
-#include <memory>
+#pragma once
 #include <string>
+#include <type_traits> // aligned_storage
+#include <cstddef> // max_align_t
+#include <cstdint>
+#include "path_table.hpp"
 
 struct ForeignWindowImpl;
 struct WindowWatcherImpl;
+class ProcessKiller;
 
 class ForeignWindow {
 // only WW has enough access to system guts to access window IDs
@@ -10,12 +15,23 @@ friend class WindowWatcher;
 friend struct WindowWatcherImpl;
 public:
 	ForeignWindow(ForeignWindow && fw);
-	void kill();
-	std::string get_window_title() const;
-	std::string get_program_path() const;
+	// asynchronous: the killer makes sure the process is gone, escalating if needed
+	void kill(ProcessKiller &) const;
+	const std::string & get_window_title() const;
+	const std::string & get_program_path() const;
+	path_id get_program_id() const; // interned get_program_path()
+	uint32_t get_process_id() const; // 0 if unknown
 	~ForeignWindow();
+	ForeignWindow(const ForeignWindow&) = delete;
+	ForeignWindow& operator=(const ForeignWindow&) = delete;
 private:
-	std::unique_ptr<ForeignWindowImpl> impl;
+	/*
+	There's a window in every event, so the backend's ForeignWindowImpl lives right here
+	instead of on the heap. Backends check that theirs fits in their constructors.
+	*/
+	static const size_t impl_size = 128;
+	std::aligned_storage<impl_size, alignof(std::max_align_t)>::type storage;
+	ForeignWindowImpl * impl; // always points to storage
 	// user doesn't know about window system and can't know their IDs
 	ForeignWindow(ForeignWindowImpl);
 };
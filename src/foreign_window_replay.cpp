@@ -0,0 +1,34 @@
+#include "foreign_window.hpp"
+#include "private_replay.hpp"
+#include <new> // placement new
+
+ForeignWindow::ForeignWindow(ForeignWindow && fw) :impl(new (&storage) ForeignWindowImpl(std::move(*fw.impl))) {}
+
+ForeignWindow::ForeignWindow(ForeignWindowImpl impl_) :impl(new (&storage) ForeignWindowImpl(std::move(impl_))) {
+	static_assert(sizeof(ForeignWindowImpl) <= impl_size, "ForeignWindowImpl doesn't fit into ForeignWindow");
+	static_assert(alignof(ForeignWindowImpl) <= alignof(std::max_align_t), "ForeignWindowImpl is overaligned");
+}
+
+const std::string & ForeignWindow::get_window_title() const {
+	return *impl->title;
+}
+
+path_id ForeignWindow::get_program_id() const {
+	return impl->program;
+}
+
+uint32_t ForeignWindow::get_process_id() const {
+	return impl->pid;
+}
+
+const std::string & ForeignWindow::get_program_path() const {
+	return PathTable::global().path(impl->program);
+}
+
+void ForeignWindow::kill(ProcessKiller &) const {
+	// the process is long gone (or was never on this machine), nothing to do
+}
+
+ForeignWindow::~ForeignWindow() {
+	impl->~ForeignWindowImpl();
+}
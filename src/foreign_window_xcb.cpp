@@ -3,31 +3,75 @@
 #include "private_xcb.hpp"
 #include <stdexcept> // runtime_error
 #include <memory> // unique_ptr
+#include <new> // placement new
 #include <sys/types.h> // pid_t
 #include <stdlib.h> // realpath
-#include <signal.h> // kill
 #include <algorithm> // find
+#include <mutex> // lock_guard
+#include <unordered_set>
+#include "lru_cache.hpp"
+#include "path_table.hpp"
+#include "process_killer.hpp"
+#include "process_table.hpp"
 
 const size_t title_path_length = 4096; // VFS has troubles coping with >256-character paths, anyway
 
-ForeignWindowImpl::ForeignWindowImpl(xcb_connection_t* conn_, xcb_window_t wid_) :conn(conn_), wid(wid_) {}
+ForeignWindowImpl::ForeignWindowImpl(xcb_connection_t* conn_, const XCB & atoms, xcb_window_t wid_)
+	:XCB(atoms), conn(conn_), wid(wid_), pid(0), title(nullptr), wm_class(nullptr),
+	program_id(PathTable::no_path) {}
 
-ForeignWindow::ForeignWindow(ForeignWindow && fw) :impl(std::move(fw.impl)) {}
+/*
+Titles and WM_CLASS values are interned, so that events carry a pointer: copying them
+out of the replies would allocate on every focus and title change. Like the paths in
+PathTable (and the titles in the usage log's string file), they're never forgotten.
+The lookup key is assigned to, so it only allocates for a value longer than ever before.
+*/
+static std::mutex property_strings_mutex;
+static std::unordered_set<std::string> property_strings;
+static std::string property_key;
 
-ForeignWindow::ForeignWindow(ForeignWindowImpl impl_) :impl(new ForeignWindowImpl(impl_)) {
-	try {
+static const std::string * intern_property(xcb_get_property_reply_t * reply) {
+	std::lock_guard<std::mutex> lock(property_strings_mutex);
+	property_key.assign(
+		reinterpret_cast<char*>(xcb_get_property_value(reply)),
+		(size_t)xcb_get_property_value_length(reply)
+	);
+	auto it = property_strings.find(property_key);
+	if (it == property_strings.end()) it = property_strings.insert(property_key).first;
+	return &*it;
+}
+
+void ForeignWindowImpl::fetch_properties() {
+	// ask for everything we may need in one go: one round trip instead of three
+	const property_request requests[] = {
 		// according to libxcb-ewmh headers, CARDINAL == uint32_t
-		impl->pid = impl->get_property<uint32_t>(impl->NET_WM_PID, XCB_ATOM_CARDINAL);
-		// now store the uint32_t in a pid_t
-	} catch (std::runtime_error & err) {
-		// some windows (e.g. Worker) just don't have _NET_WM_PID set
-		// also, this could be a remote window, if the user had enough reasons to use them
-		impl->pid = 0;
-	}
+		{NET_WM_PID, XCB_ATOM_CARDINAL, sizeof(uint32_t)},
+		{NET_WM_NAME, UTF8_STRING, title_path_length},
+		// WM_CLASS is only needed when PID lookup fails, but asking for it costs no extra latency
+		{XCB_ATOM_WM_CLASS, XCB_ATOM_STRING, title_path_length}
+	};
+	property_reply replies[3];
+	get_property_replies(requests, replies);
+	// some windows (e.g. Worker) just don't have _NET_WM_PID set
+	// also, this could be a remote window, if the user had enough reasons to use them
+	// now store the uint32_t in a pid_t
+	pid = replies[0] ? *reinterpret_cast<uint32_t*>(xcb_get_property_value(replies[0].get())) : 0;
+	title = replies[1] ? intern_property(replies[1].get()) : nullptr;
+	wm_class = replies[2] ? intern_property(replies[2].get()) : nullptr;
+}
+
+ForeignWindow::ForeignWindow(ForeignWindow && fw) :impl(new (&storage) ForeignWindowImpl(std::move(*fw.impl))) {}
+
+// the backend fetches the properties, if the event needs them
+ForeignWindow::ForeignWindow(ForeignWindowImpl impl_) :impl(new (&storage) ForeignWindowImpl(std::move(impl_))) {
+	static_assert(sizeof(ForeignWindowImpl) <= impl_size, "ForeignWindowImpl doesn't fit into ForeignWindow");
+	static_assert(alignof(ForeignWindowImpl) <= alignof(std::max_align_t), "ForeignWindowImpl is overaligned");
 }
 
-std::string ForeignWindow::get_window_title() const {
-	return impl->get_property(impl->NET_WM_NAME, title_path_length);
+const std::string & ForeignWindow::get_window_title() const {
+	if (!impl->title)
+		throw std::runtime_error("xcb_get_property returned error");
+	return *impl->title;
 }
 
 static std::string executable_path(pid_t pid) { // XXX: this is Linux-only, see sysctl calls on *BSD and proc_pidpath on macOS
@@ -39,30 +83,124 @@ static std::string executable_path(pid_t pid) { // XXX: this is Linux-only, see
 	return std::string(path.get());
 }
 
-std::string ForeignWindow::get_program_path() const {
-	try {
-		if (impl->pid)
-			return executable_path(impl->pid);
+/*
+Focus keeps bouncing between the same handful of windows, so remember what we've
+resolved. Windows are remembered by connection and ID (a window can't change its owner;
+different displays reuse the same IDs), processes (the windows' own, and whatever runs
+in the foreground of a terminal) by PID validated with their start time (so a reused
+PID can't return a stale path).
+Only ever touched from the thread calling get_program_path(), but lock anyway.
+*/
+const size_t window_cache_size = 256, process_cache_size = 128;
+
+struct process_cache_entry {
+	unsigned long long start_time;
+	path_id path;
+};
+
+typedef std::pair<xcb_connection_t*,xcb_window_t> window_key;
+
+struct window_key_hash {
+	size_t operator()(const window_key & key) const {
+		return std::hash<xcb_connection_t*>()(key.first) * 31 ^ key.second;
+	}
+};
+
+struct window_cache_entry {
+	pid_t pid; // 0 if the path came from WM_CLASS
+	path_id path;
+};
+
+static std::mutex path_cache_mutex;
+static lru_cache<pid_t,process_cache_entry> process_cache(process_cache_size);
+static lru_cache<window_key,window_cache_entry,window_key_hash> window_cache(window_cache_size);
+
+// call with path_cache_mutex held
+static path_id process_path(pid_t pid) {
+	unsigned long long start_time = process_start_time(pid);
+	process_cache_entry * cached = process_cache.find(pid);
+	if (cached && start_time && cached->start_time == start_time)
+		return cached->path;
+	path_id path = PathTable::global().intern(executable_path(pid));
+	if (start_time) // process may have died in between, don't remember it then
+		process_cache.insert(pid, {start_time, path});
+	return path;
+}
+
+static path_id resolve_program_path(const ForeignWindowImpl & impl) {
+	if (impl.pid) try {
+		return process_path(impl.pid);
 	} catch (std::runtime_error &) {} // paranoid kernel doesn't let us peek at /proc? oh well
 	// anyway, if we've got here, we can't know the PID of the window owner
 	// get the full WM_CLASS value instead
-	std::string wm_class = impl->get_property(XCB_ATOM_WM_CLASS,title_path_length,XCB_ATOM_STRING);
+	if (!impl.wm_class)
+		throw std::runtime_error("xcb_get_property returned error");
+	std::string wm_class = *impl.wm_class;
 	// cut the "instance class" (before \0) and leave the "app class" (after first \0)
 	wm_class.erase(wm_class.begin(), std::find(wm_class.begin(), wm_class.end(), '\0'));
-	return wm_class;
+	return PathTable::global().intern(wm_class);
+}
+
+path_id ForeignWindow::get_program_id() const {
+	if (impl->program_id == PathTable::no_path) {
+		{
+			std::lock_guard<std::mutex> lock(path_cache_mutex);
+			window_cache_entry * cached = window_cache.find({impl->conn, impl->wid});
+			if (cached && cached->pid == impl->pid) {
+				impl->program_id = cached->path;
+			} else {
+				impl->program_id = resolve_program_path(*impl);
+				window_cache.insert({impl->conn, impl->wid}, {impl->pid, impl->program_id});
+			}
+		}
+		// terminals and the like get no credit for what runs in them; what's in the foreground
+		// changes all the time, so that's looked up every time, but its path is cached like the host's
+		ProcessTable & processes = ProcessTable::global();
+		if (impl->pid && processes.is_host(impl->program_id)) {
+			pid_t foreground = processes.foreground(impl->pid);
+			if (foreground) try {
+				std::lock_guard<std::mutex> lock(path_cache_mutex);
+				impl->program_id = process_path(foreground);
+			} catch (std::runtime_error &) {} // gone already, or not ours to look at: the host it is
+		}
+	}
+	return impl->program_id;
 }
 
-void ForeignWindow::kill() {
-	if (impl->pid && !::kill(impl->pid,SIGTERM))
-			return; // we successfully killed the process by its PID
-	// if we're still here, let's try to kill the window instead
-	// X11 has no security between clients, so we should probably succeed (but the app owning the window may be very surprised)
-	xcb_void_cookie_t kill_cookie = xcb_kill_client_checked(impl->conn, impl->wid);
-	std::unique_ptr<xcb_generic_error_t,decltype(&free)> error {xcb_request_check(impl->conn, kill_cookie),&free};
-	// man xcb-requests says I should free result of xcb_request_check
-	if (error)
-		throw std::runtime_error("xcb_kill_client returned error");
+uint32_t ForeignWindow::get_process_id() const {
+	return impl->pid;
 }
 
-// work around unique_ptr asking for destructor while compiling public headers
-ForeignWindow::~ForeignWindow() = default;
+const std::string & ForeignWindow::get_program_path() const {
+	return PathTable::global().path(get_program_id());
+}
+
+void ForeignWindow::kill(ProcessKiller & killer) const {
+	if (impl->pid) {
+		// if we've resolved the path, we know which process the PID meant back then
+		unsigned long long start_time = 0;
+		{
+			std::lock_guard<std::mutex> lock(path_cache_mutex);
+			process_cache_entry * cached = process_cache.find(impl->pid);
+			if (cached) start_time = cached->start_time;
+		}
+		// X11 has no security between clients, so disconnecting it should work if signals don't
+		// (but the app owning the window may be very surprised)
+		xcb_connection_t * conn = impl->conn;
+		xcb_window_t wid = impl->wid;
+		killer.kill(impl->pid, start_time, [conn, wid](pid_t, ProcessKiller::Outcome outcome) {
+			if (outcome != ProcessKiller::Outcome::failed) return;
+			xcb_kill_client(conn, wid);
+			xcb_flush(conn);
+		});
+		return;
+	}
+	if (impl->wid == XCB_WINDOW_NONE) return; // an event without a window; killing "window 0" kills every client that has asked to be
+	// no PID, so kill the window instead; unchecked, if it's gone already the error just shows up in the event loop
+	xcb_kill_client(impl->conn, impl->wid);
+	xcb_flush(impl->conn);
+}
+
+ForeignWindow::~ForeignWindow() {
+	impl->~ForeignWindowImpl();
+}
@@ -0,0 +1,70 @@
+#pragma once
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <functional>
+#include <cstddef>
+
+/*
+Usage:
+
+1) Create an lru_cache<Key,Value> cache(capacity);
+2) cache.find(key) returns a pointer to the cached value (or nullptr) and marks
+the entry as recently used. Lookups never allocate.
+3) cache.insert(key, value) adds or replaces an entry, evicting the least
+recently used one once the capacity is reached.
+4) The cache isn't synchronized: guard it with a mutex if several threads use it.
+*/
+
+template <typename K, typename V, typename Hash = std::hash<K>>
+class lru_cache {
+private:
+	typedef std::pair<K,V> entry;
+	std::list<entry> entries; // most recently used first
+	std::unordered_map<K,typename std::list<entry>::iterator,Hash> index;
+	size_t capacity;
+public:
+	explicit lru_cache(size_t capacity_) : capacity(capacity_ ? capacity_ : 1) {
+		index.reserve(capacity);
+	}
+
+	V* find(const K & key) {
+		auto it = index.find(key);
+		if (it == index.end()) return nullptr;
+		// splice only relinks the nodes, no allocation happens
+		entries.splice(entries.begin(), entries, it->second);
+		return &it->second->second;
+	}
+
+	V& insert(const K & key, V value) {
+		auto it = index.find(key);
+		if (it != index.end()) {
+			it->second->second = std::move(value);
+			entries.splice(entries.begin(), entries, it->second);
+			return it->second->second;
+		}
+		if (entries.size() >= capacity) {
+			index.erase(entries.back().first);
+			entries.pop_back();
+		}
+		entries.emplace_front(key, std::move(value));
+		index[key] = entries.begin();
+		return entries.front().second;
+	}
+
+	void erase(const K & key) {
+		auto it = index.find(key);
+		if (it == index.end()) return;
+		entries.erase(it->second);
+		index.erase(it);
+	}
+
+	void clear() {
+		index.clear();
+		entries.clear();
+	}
+
+	size_t size() const {
+		return entries.size();
+	}
+};
@@ -0,0 +1,30 @@
+#include "metrics.hpp"
+#include <iomanip>
+
+PipelineMetrics & PipelineMetrics::global() {
+	static PipelineMetrics metrics;
+	return metrics;
+}
+
+static void dump_histogram(std::ostream & out, const char * name, const latency_histogram & h) {
+	latency_histogram::snapshot s = h.read();
+	out << std::left << std::setw(16) << name << std::right << std::setw(10) << s.count;
+	for (double q : {0.5, 0.9, 0.99, 0.999, 1.0})
+		out << std::setw(12) << std::fixed << std::setprecision(1)
+			<< std::chrono::duration<double,std::micro>(s.quantile(q)).count();
+	out << '\n';
+}
+
+void PipelineMetrics::dump(std::ostream & out) const {
+	out << "window system errors: " << errors << '\n';
+	out << std::left << std::setw(16) << "stage (us)" << std::right << std::setw(10) << "count";
+	for (const char * q : {"p50", "p90", "p99", "p99.9", "max"})
+		out << std::setw(12) << q;
+	out << '\n';
+	dump_histogram(out, "event_read", event_read);
+	dump_histogram(out, "property_fetch", property_fetch);
+	dump_histogram(out, "queue_dwell", queue_dwell);
+	dump_histogram(out, "handle_event", handle_event);
+	dump_histogram(out, "event_lag", event_lag);
+	out << std::flush;
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <cstdint>
+
+/*
+Latency histogram cheap enough to stay on in production: recording is a bucket
+computation and one relaxed atomic increment, with no locks, so any thread may
+record while another one reads.
+
+Buckets are log-linear like in HdrHistogram: every power of two is split into
+2^sub_bits linear sub-buckets, so any recorded value is off by less than 1/2^sub_bits
+(12.5%), from nanoseconds to centuries.
+*/
+
+class latency_histogram {
+public:
+	typedef std::chrono::steady_clock clock;
+	static const unsigned sub_bits = 3;
+	static const unsigned bucket_count = (64 - sub_bits + 1) << sub_bits;
+
+	latency_histogram() {
+		for (std::atomic<uint64_t> & c : counts) c.store(0, std::memory_order_relaxed);
+	}
+
+	void record(clock::duration d) {
+		int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+		counts[bucket(ns > 0 ? ns : 0)].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// records the time until the end of the scope
+	class timed {
+	public:
+		explicit timed(latency_histogram & h_) : h(h_), start(clock::now()) {}
+		~timed() { h.record(clock::now() - start); }
+		timed(const timed&) = delete;
+		timed& operator=(const timed&) = delete;
+	private:
+		latency_histogram & h;
+		clock::time_point start;
+	};
+
+	// consistent copy of the counts; recording may go on meanwhile
+	struct snapshot {
+		uint64_t counts[bucket_count];
+		uint64_t count;
+		// upper bound of the bucket the q-th quantile (0..1) falls into, 0 if empty
+		std::chrono::nanoseconds quantile(double q) const {
+			uint64_t rank = q * count, seen = 0;
+			for (unsigned i = 0; i < bucket_count; i++) {
+				seen += counts[i];
+				if (seen > rank || (seen == count && seen)) return std::chrono::nanoseconds(upper_bound(i));
+			}
+			return std::chrono::nanoseconds(0);
+		}
+	};
+	snapshot read() const {
+		snapshot ret;
+		ret.count = 0;
+		for (unsigned i = 0; i < bucket_count; i++)
+			ret.count += ret.counts[i] = counts[i].load(std::memory_order_relaxed);
+		return ret;
+	}
+
+	latency_histogram(const latency_histogram&) = delete;
+	latency_histogram& operator=(const latency_histogram&) = delete;
+private:
+	std::atomic<uint64_t> counts[bucket_count];
+
+	static unsigned bucket(uint64_t v) {
+		if (v < (1u << sub_bits)) return v; // exact
+		unsigned msb = 63 - __builtin_clzll(v);
+		return ((msb - sub_bits + 1) << sub_bits) + ((v >> (msb - sub_bits)) & ((1u << sub_bits) - 1));
+	}
+	static int64_t upper_bound(unsigned b) {
+		if (b < (1u << sub_bits)) return b;
+		unsigned shift = (b >> sub_bits) - 1;
+		uint64_t lower = uint64_t((1u << sub_bits) + (b & ((1u << sub_bits) - 1))) << shift;
+		return lower + (uint64_t(1) << shift) - 1;
+	}
+};
+
+/*
+Where the time goes between the window system noticing something and Statistics
+recording it. Everything is process-wide, so that both the backends and the event
+loop can record without being handed anything.
+*/
+struct PipelineMetrics {
+	latency_histogram event_read; // window system event received -> resulting WindowEvents queued
+	latency_histogram property_fetch; // one round trip for window properties
+	latency_histogram queue_dwell; // WindowEvent created -> taken out of the queue
+	latency_histogram handle_event; // WindowWatcher::handle_event
+	latency_histogram event_lag; // event captured -> handled, all of the above together
+	std::atomic<uint64_t> errors; // reported by the window system
+	static PipelineMetrics & global();
+	void dump(std::ostream &) const;
+private:
+	PipelineMetrics() : errors(0) {}
+};
@@ -0,0 +1,38 @@
+#include "path_table.hpp"
+#include <stdexcept>
+
+const path_id PathTable::no_path;
+
+PathTable::PathTable() : paths(1, nullptr) {} // ID 0 is no_path
+
+PathTable & PathTable::global() {
+	static PathTable table;
+	return table;
+}
+
+path_id PathTable::intern(const std::string & path) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = ids.find(path);
+	if (it != ids.end()) return it->second;
+	it = ids.insert({path, (path_id)paths.size()}).first;
+	paths.push_back(&it->first);
+	return it->second;
+}
+
+path_id PathTable::find(const std::string & path) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = ids.find(path);
+	return it == ids.end() ? no_path : it->second;
+}
+
+const std::string & PathTable::path(path_id id) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (id == no_path || id >= paths.size())
+		throw std::out_of_range("unknown path ID");
+	return *paths[id];
+}
+
+size_t PathTable::size() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return paths.size() - 1;
+}
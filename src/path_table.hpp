@@ -0,0 +1,47 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <cstdint>
+
+/*
+Maps every program path ever seen to a small dense integer, so that once a program
+has been seen, checking it against a list is a single integer probe instead of a
+series of string comparisons. Paths are never forgotten: there are only so many
+programs on a machine.
+*/
+
+typedef uint32_t path_id;
+
+class PathTable {
+public:
+	static const path_id no_path = 0; // never returned by intern()
+	static PathTable & global();
+	path_id intern(const std::string&);
+	path_id find(const std::string&) const; // no_path if the path was never interned
+	const std::string & path(path_id) const; // reference stays valid forever
+	size_t size() const;
+private:
+	PathTable();
+	mutable std::mutex mutex;
+	std::unordered_map<std::string,path_id> ids;
+	std::vector<const std::string*> paths; // points into ids' keys, which never move
+};
+
+/*
+Set of path IDs stored as a bitset: IDs are dense, so this is both smaller and
+faster than hashing them.
+*/
+class PathIdSet {
+public:
+	void insert(path_id id) {
+		if (id/64 >= bits.size()) bits.resize(id/64 + 1, 0);
+		bits[id/64] |= uint64_t(1) << (id%64);
+	}
+	bool contains(path_id id) const {
+		return id/64 < bits.size() && (bits[id/64] >> (id%64) & 1);
+	}
+private:
+	std::vector<uint64_t> bits;
+};
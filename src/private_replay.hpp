@@ -0,0 +1,11 @@
+#pragma once
+#include "path_table.hpp"
+#include <string>
+#include <cstdint>
+
+// a window that only exists in a trace
+struct ForeignWindowImpl {
+	uint32_t pid;
+	path_id program;
+	const std::string * title; // interned by the backend, so that events don't allocate
+};
@@ -1,19 +1,82 @@
 #include <xcb/xcb.h>
 #include <memory>
 #include <stdexcept>
+#include <string>
+#include <vector>
+#include "path_table.hpp"
+#include "metrics.hpp"
+
+// a struct, not &free, so that arrays of replies could start out empty
+struct free_deleter {
+	void operator()(void * p) const { std::free(p); }
+};
+typedef std::unique_ptr<xcb_get_property_reply_t,free_deleter> property_reply;
 
 struct XCB {
-	static xcb_atom_t NET_ACTIVE_WINDOW;
-	static xcb_atom_t NET_WM_NAME;
-	static xcb_atom_t UTF8_STRING;
-	static xcb_atom_t NET_WM_PID;
+	// atom values are up to the X server, so every connection has its own
+	xcb_atom_t NET_ACTIVE_WINDOW;
+	xcb_atom_t NET_WM_NAME;
+	xcb_atom_t UTF8_STRING;
+	xcb_atom_t NET_WM_PID;
+
+	XCB() : NET_ACTIVE_WINDOW(XCB_ATOM_NONE), NET_WM_NAME(XCB_ATOM_NONE), UTF8_STRING(XCB_ATOM_NONE), NET_WM_PID(XCB_ATOM_NONE) {}
+
+	void intern_atoms(xcb_connection_t* conn) {
+		std::vector<xcb_atom_t> atoms = get_atoms(conn, {
+			"_NET_WM_NAME", "_NET_ACTIVE_WINDOW", "UTF8_STRING", "_NET_WM_PID"
+		});
+		NET_WM_NAME = atoms[0];
+		NET_ACTIVE_WINDOW = atoms[1];
+		UTF8_STRING = atoms[2];
+		NET_WM_PID = atoms[3];
+	}
+
+	/*
+	Interns all the atoms at once: every cookie is sent before the first reply
+	is awaited, so the whole list costs a single round trip to the X server.
+	*/
+	static std::vector<xcb_atom_t> get_atoms(xcb_connection_t* conn, const std::vector<std::string> & names) {
+		std::vector<xcb_intern_atom_cookie_t> cookies;
+		cookies.reserve(names.size());
+		for (const std::string & name : names)
+			cookies.push_back(xcb_intern_atom(conn, 0, name.length(), name.c_str()));
+
+		std::vector<xcb_atom_t> atoms;
+		atoms.reserve(names.size());
+		for (size_t i = 0; i < cookies.size(); i++) {
+			xcb_generic_error_t *err = nullptr;
+			std::unique_ptr<xcb_intern_atom_reply_t,decltype(&free)> reply{
+				xcb_intern_atom_reply(conn, cookies[i], &err), &free
+			};
+			if (!reply) {
+				free(err);
+				// don't leave unclaimed replies hanging in the connection
+				for (size_t j = i+1; j < cookies.size(); j++)
+					xcb_discard_reply(conn, cookies[j].sequence);
+				throw std::runtime_error("xcb_intern_atom returned error");
+			}
+			atoms.push_back(reply->atom);
+		}
+		return atoms;
+	}
 };
 
 struct ForeignWindowImpl : public XCB {
 	xcb_connection_t* conn;
 	xcb_window_t wid;
 	pid_t pid;
-	ForeignWindowImpl(xcb_connection_t*, xcb_window_t);
+	// filled by fetch_properties(), interned (see there); null if the window didn't have the property
+	const std::string * title, * wm_class;
+	// resolved lazily by ForeignWindow::get_program_id()
+	path_id program_id;
+	ForeignWindowImpl(xcb_connection_t*, const XCB & atoms, xcb_window_t);
+	void fetch_properties();
+
+	struct property_request {
+		xcb_atom_t atom;
+		xcb_atom_t type;
+		size_t len;
+	};
 
 	template<typename T>
 	T get_property(xcb_atom_t atom, xcb_atom_t type, size_t len = sizeof(T)) {
@@ -24,37 +87,69 @@ struct ForeignWindowImpl : public XCB {
 		);
 	}
 
-	std::string get_property(xcb_atom_t atom, size_t len, xcb_atom_t type = UTF8_STRING) {
-		auto reply = get_property_reply(atom, type, len);
+	std::string get_property(xcb_atom_t atom, size_t len, xcb_atom_t type) {
+		return property_string(get_property_reply(atom, type, len).get());
+	}
+
+	static std::string property_string(xcb_get_property_reply_t * reply) {
 		return std::string(
 			reinterpret_cast<char*>(
 				xcb_get_property_value(
-					reply.get()
+					reply
 				)
 			),
-			(size_t)xcb_get_property_value_length(reply.get()) // WHY should it have been int?
+			(size_t)xcb_get_property_value_length(reply) // WHY should it have been int?
 		);
 	}
-private:
-	std::unique_ptr<xcb_get_property_reply_t,decltype(&std::free)>
-	get_property_reply(xcb_atom_t atom, xcb_atom_t type, size_t len) {
-		using std::unique_ptr;
-		using std::runtime_error;
-		xcb_generic_error_t *err = nullptr; // can't use unique_ptr here because get_property_reply overwrites pointer value
 
+	/*
+	Pipelined version of get_property_reply: sends all the requests first, then
+	collects the replies, so N properties cost one round trip instead of N.
+	Doesn't throw on a missing property; the corresponding reply is null instead.
+	Fixed-size arrays, so that it's called on every event without allocating
+	(but what libxcb allocates for the replies).
+	*/
+	template <size_t N>
+	void get_property_replies(const property_request (&requests)[N], property_reply (&replies)[N]) {
+		latency_histogram::timed timing(PipelineMetrics::global().property_fetch);
+		xcb_get_property_cookie_t cookies[N];
+		for (size_t i = 0; i < N; i++)
+			cookies[i] = xcb_get_property(
+				conn, 0, wid, requests[i].atom, requests[i].type, 0, property_length(requests[i].len)
+			);
+
+		for (size_t i = 0; i < N; i++) {
+			xcb_generic_error_t *err = nullptr;
+			replies[i].reset(xcb_get_property_reply(conn, cookies[i], &err));
+			if (err) PipelineMetrics::global().errors++;
+			free(err);
+			if (replies[i] && requests[i].len && !xcb_get_property_value_length(replies[i].get()))
+				replies[i].reset();
+		}
+	}
+private:
+	static uint32_t property_length(size_t len) {
 		/*
 		Specifies how many 32-bit multiples of data should be retrieved
 		(e.g. if you set long_length to 4, you will receive 16 bytes of data).
 		*/
-		uint32_t ret_size = len/sizeof(uint32_t)/*integer division, like floor()*/ + !!(len%sizeof(uint32_t))/*+1 if there was a remainder*/;
+		return len/sizeof(uint32_t)/*integer division, like floor()*/ + !!(len%sizeof(uint32_t))/*+1 if there was a remainder*/;
+	}
+
+	property_reply
+	get_property_reply(xcb_atom_t atom, xcb_atom_t type, size_t len) {
+		using std::runtime_error;
+		xcb_generic_error_t *err = nullptr; // can't use unique_ptr here because get_property_reply overwrites pointer value
 
+		latency_histogram::timed timing(PipelineMetrics::global().property_fetch);
 		xcb_get_property_cookie_t cookie = xcb_get_property(
-			conn, 0, wid, atom, type, 0, ret_size
+			conn, 0, wid, atom, type, 0, property_length(len)
 		);
-		unique_ptr<xcb_get_property_reply_t,decltype(&std::free)> reply {xcb_get_property_reply(conn, cookie, &err),&free};
+		property_reply reply {xcb_get_property_reply(conn, cookie, &err)};
 
 		if (!reply) {
 			free(err);
+			PipelineMetrics::global().errors++;
 			throw runtime_error("xcb_get_property returned error");
 		}
 
@@ -0,0 +1,267 @@
+#include "process_killer.hpp"
+#include <stdexcept>
+#include <cerrno>
+#include <cstdlib> // strtol
+#include <signal.h>
+#include <poll.h>
+#include <dirent.h>
+#include <unistd.h> // read, close, getpgid
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+// glibc only got wrappers for these in 2.36
+static int pidfd_open(pid_t pid) {
+	return syscall(SYS_pidfd_open, pid, 0);
+}
+
+static int pidfd_send_signal(int pidfd, int sig) {
+	return syscall(SYS_pidfd_send_signal, pidfd, sig, nullptr, 0);
+}
+
+// without pidfd support, exits are noticed this late at most
+static const std::chrono::milliseconds exit_poll_interval(100);
+
+// every process whose chain of parents leads to `root`, parents before their children
+static std::vector<pid_t> descendants(pid_t root) {
+	std::unordered_map<pid_t,std::vector<pid_t>> children;
+	DIR * proc = opendir("/proc");
+	if (!proc) return {};
+	while (struct dirent * entry = readdir(proc)) {
+		char * end;
+		pid_t pid = strtol(entry->d_name, &end, 10);
+		proc_stat st;
+		if (*end || pid <= 0 || !read_proc_stat(pid, st)) continue;
+		children[st.ppid].push_back(pid);
+	}
+	closedir(proc);
+	std::vector<pid_t> ret;
+	ret.push_back(root);
+	for (size_t i = 0; i < ret.size(); i++) {
+		auto it = children.find(ret[i]);
+		if (it != children.end())
+			ret.insert(ret.end(), it->second.begin(), it->second.end());
+	}
+	ret.erase(ret.begin());
+	return ret;
+}
+
+ProcessKiller::ProcessKiller(Policy policy_)
+	: epoll_fd(-1), wake_fd(-1), policy(policy_), in_flight(0), stopping(false) {
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) throw std::runtime_error("epoll_create1 returned error");
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd < 0) {
+		close(epoll_fd);
+		throw std::runtime_error("eventfd returned error");
+	}
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.fd = wake_fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev)) {
+		close(wake_fd);
+		close(epoll_fd);
+		throw std::runtime_error("epoll_ctl returned error");
+	}
+}
+
+ProcessKiller::~ProcessKiller() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	uint64_t one = 1;
+	if (write(wake_fd, &one, sizeof one)) {} // can only fail if the counter is full, which wakes it up anyway
+	if (thread.joinable()) thread.join();
+	for (request & r : requests)
+		if (r.pidfd >= 0) close(r.pidfd);
+	for (auto & t : targets)
+		if (t.second.pidfd >= 0) close(t.second.pidfd);
+	close(wake_fd);
+	close(epoll_fd);
+}
+
+void ProcessKiller::set_policy(Policy p) {
+	std::lock_guard<std::mutex> lock(mutex);
+	policy = p;
+}
+
+void ProcessKiller::kill(pid_t pid, unsigned long long start_time, callback done) {
+	// pin the process as early as possible, the rest can wait for the thread
+	int pidfd = -1;
+	if (pid > 0) {
+		pidfd = pidfd_open(pid);
+		if (pidfd < 0 && errno != ENOSYS)
+			pid = 0; // gone already
+	}
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		requests.push_back({pid, pidfd, start_time, policy, std::move(done)});
+		in_flight++;
+		// most watchers never kill anything, so they don't get a thread until they do
+		if (!thread.joinable()) thread = std::thread(&ProcessKiller::loop, this);
+	}
+	uint64_t one = 1;
+	if (write(wake_fd, &one, sizeof one)) {}
+}
+
+size_t ProcessKiller::pending() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return in_flight;
+}
+
+int ProcessKiller::signal(const target & t, int sig) {
+	int ret;
+	if (t.group)
+		ret = ::kill(-t.group, sig);
+	else if (t.pidfd >= 0)
+		ret = pidfd_send_signal(t.pidfd, sig);
+	else
+		ret = ::kill(t.pid, sig);
+	return ret ? errno : 0;
+}
+
+bool ProcessKiller::alive(const target & t) const {
+	if (t.pidfd >= 0) {
+		// a pidfd becomes readable once its process exits
+		struct pollfd p = {t.pidfd, POLLIN, 0};
+		return poll(&p, 1, 0) == 0;
+	}
+	return !::kill(t.pid, 0) || errno == EPERM;
+}
+
+void ProcessKiller::track(target && t) {
+	int key = t.pidfd >= 0 ? t.pidfd : -t.pid;
+	if (t.pidfd >= 0) {
+		struct epoll_event ev = {};
+		ev.events = EPOLLIN;
+		ev.data.fd = t.pidfd;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, t.pidfd, &ev)) {
+			// can't wait for it, but SIGKILL still has to be sent: fall back to polling
+			close(t.pidfd);
+			t.pidfd = -1;
+			key = -t.pid;
+		}
+	}
+	targets[key] = std::move(t);
+}
+
+void ProcessKiller::start(request & r) {
+	target root {r.pid, r.pidfd, 0, clock::now() + r.policy.grace, false, true, std::move(r.done)};
+	int key = root.pidfd >= 0 ? root.pidfd : -root.pid;
+	// with the pidfd open, the PID can't be reused anymore, so what /proc says is about our process
+	if (!root.pid || (r.start_time && process_start_time(root.pid) != r.start_time)) {
+		targets[key] = std::move(root);
+		finish(key, Outcome::gone);
+		return;
+	}
+	// children get reparented once their parent dies, so look them up before sending anything
+	std::vector<target> family;
+	if (r.policy.scope == Scope::descendants) {
+		for (pid_t pid : descendants(root.pid)) {
+			int pidfd = pidfd_open(pid);
+			if (pidfd < 0 && errno != ENOSYS) continue; // gone
+			family.push_back({pid, pidfd, 0, root.deadline, false, false, nullptr});
+		}
+	} else if (r.policy.scope == Scope::process_group) {
+		pid_t group = getpgid(root.pid);
+		if (group > 0 && group != getpgrp()) root.group = group;
+	}
+	int error = signal(root, SIGTERM);
+	if (error) {
+		targets[key] = std::move(root);
+		finish(key, error == ESRCH ? Outcome::gone : Outcome::failed);
+		return;
+	}
+	for (target & t : family) {
+		if (signal(t, SIGTERM)) {
+			if (t.pidfd >= 0) close(t.pidfd);
+			continue;
+		}
+		track(std::move(t));
+	}
+	track(std::move(root));
+}
+
+void ProcessKiller::finish(int key, Outcome outcome) {
+	auto it = targets.find(key);
+	if (it == targets.end()) return;
+	target t = std::move(it->second);
+	targets.erase(it);
+	if (t.pidfd >= 0) {
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, t.pidfd, nullptr);
+		close(t.pidfd);
+	}
+	if (!t.requested) return;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		in_flight--;
+	}
+	if (t.done) try {
+		t.done(t.pid, outcome);
+	} catch (...) {} // noone to report it to on this thread
+}
+
+void ProcessKiller::escalate(clock::time_point now) {
+	std::vector<std::pair<int,Outcome>> gone;
+	for (auto & entry : targets) {
+		target & t = entry.second;
+		if (t.pidfd < 0 && !alive(t)) { // only pidfds tell epoll about exits
+			gone.push_back({entry.first, t.escalated ? Outcome::killed : Outcome::exited});
+			continue;
+		}
+		if (t.escalated || t.deadline > now) continue;
+		t.escalated = true;
+		if (!alive(t)) continue; // epoll will tell
+		int error = signal(t, SIGKILL);
+		if (error == ESRCH && t.pidfd < 0)
+			gone.push_back({entry.first, Outcome::exited});
+		else if (error && error != ESRCH)
+			gone.push_back({entry.first, Outcome::failed});
+	}
+	for (const std::pair<int,Outcome> & g : gone)
+		finish(g.first, g.second);
+}
+
+int ProcessKiller::wait_timeout(clock::time_point now) const {
+	clock::duration timeout = clock::duration::max();
+	for (const auto & entry : targets) {
+		const target & t = entry.second;
+		if (!t.escalated && t.deadline - now < timeout)
+			timeout = t.deadline - now;
+		if (t.pidfd < 0 && exit_poll_interval < timeout)
+			timeout = exit_poll_interval;
+	}
+	if (timeout == clock::duration::max()) return -1;
+	if (timeout <= clock::duration::zero()) return 0;
+	// round up, or we'd wake up just before the deadline and spin
+	return std::chrono::duration_cast<std::chrono::milliseconds>(timeout + std::chrono::milliseconds(1) - clock::duration(1)).count();
+}
+
+void ProcessKiller::loop() {
+	std::vector<request> starting;
+	struct epoll_event events[16];
+	for (;;) {
+		int n = epoll_wait(epoll_fd, events, sizeof events / sizeof *events, wait_timeout(clock::now()));
+		if (n < 0 && errno != EINTR) n = 0; // nothing sensible to do about it, deadlines still get checked
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.fd == wake_fd) {
+				uint64_t count;
+				if (read(wake_fd, &count, sizeof count)) {}
+				continue;
+			}
+			auto it = targets.find(events[i].data.fd);
+			if (it != targets.end())
+				finish(it->first, it->second.escalated ? Outcome::killed : Outcome::exited);
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (stopping) return;
+			starting.swap(requests);
+		}
+		for (request & r : starting)
+			start(r);
+		starting.clear();
+		escalate(clock::now());
+	}
+}
@@ -0,0 +1,96 @@
+#pragma once
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+#include <sys/types.h> // pid_t
+#include "process_table.hpp" // process_start_time
+
+/*
+Terminates processes and makes sure they're gone (Linux-only: pidfd, epoll, eventfd).
+
+kill() opens a pidfd right away, which pins the process: from then on, a reused PID
+can't get our signals by mistake. Pass the start time remembered together with the PID
+(see process_start_time) to also catch reuse that happened before that. The rest
+happens on a single background thread, started by the first kill() and shared by
+however many kills are in flight: it sends SIGTERM, waits on all the pidfds in one
+epoll_wait() and sends SIGKILL to whatever is still alive after the grace period.
+
+Scope::process_group signals the whole group of the process instead (never our own),
+but only waits for the process itself; Scope::descendants signals and waits for
+every descendant too, each with its own pidfd.
+
+Kernels without pidfd_open (before 5.3) get plain kill() and are polled for exit.
+*/
+
+class ProcessKiller {
+public:
+	typedef std::chrono::steady_clock clock;
+	enum class Scope {
+		process,
+		process_group,
+		descendants
+	};
+	struct Policy {
+		clock::duration grace; // between SIGTERM and SIGKILL
+		Scope scope;
+		Policy(clock::duration grace_ = std::chrono::seconds(3), Scope scope_ = Scope::process)
+			: grace(grace_), scope(scope_) {}
+	};
+	enum class Outcome {
+		exited, // after SIGTERM
+		killed, // needed SIGKILL
+		gone, // had already exited, or the PID belongs to someone else now
+		failed // not ours to kill (EPERM)
+	};
+	// called on the background thread, once per kill(), when the process is gone
+	typedef std::function<void(pid_t, Outcome)> callback;
+
+	explicit ProcessKiller(Policy = Policy());
+	~ProcessKiller(); // stops waiting; processes still alive don't get SIGKILL
+	void set_policy(Policy);
+	// start_time == 0 skips the PID reuse check
+	void kill(pid_t, unsigned long long start_time = 0, callback done = nullptr);
+	size_t pending(); // processes signalled, but not gone yet
+
+	ProcessKiller(const ProcessKiller&) = delete;
+	ProcessKiller& operator=(const ProcessKiller&) = delete;
+private:
+	struct request {
+		pid_t pid;
+		int pidfd; // -1 without pidfd support
+		unsigned long long start_time;
+		Policy policy;
+		callback done;
+	};
+	struct target {
+		pid_t pid;
+		int pidfd;
+		pid_t group; // signal the group instead, 0 if not
+		clock::time_point deadline;
+		bool escalated;
+		bool requested; // false for descendants, which nobody waits for
+		callback done;
+	};
+	int epoll_fd, wake_fd;
+	std::mutex mutex; // guards everything up to `stopping`
+	Policy policy;
+	std::vector<request> requests; // waiting for the thread
+	size_t in_flight;
+	bool stopping;
+	// only touched by the thread; by pidfd, or by negated PID without pidfd support
+	std::unordered_map<int,target> targets;
+	std::thread thread;
+
+	void loop();
+	void start(request &);
+	void track(target &&);
+	int signal(const target &, int sig); // 0 or errno
+	void finish(int key, Outcome);
+	bool alive(const target &) const;
+	void escalate(clock::time_point now);
+	int wait_timeout(clock::time_point now) const;
+};
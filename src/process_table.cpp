@@ -0,0 +1,222 @@
+#include "process_table.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio> // snprintf, sscanf
+#include <cstdlib> // strtol
+#include <cstring> // strrchr
+#include <dirent.h>
+#include <fcntl.h> // open
+#include <unistd.h> // read, close
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+
+// without fork/exit events, new processes show up this late at most
+static const std::chrono::milliseconds scan_interval(250);
+// terminal, maybe a server process of it, maybe a wrapper, then the shell
+static const int max_session_depth = 3;
+
+bool read_proc_stat(pid_t pid, proc_stat & st) { // XXX: Linux-only
+	char name[32];
+	snprintf(name, sizeof name, "/proc/%d/stat", (int)pid);
+	int fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return false;
+	char buf[1024];
+	ssize_t len = read(fd, buf, sizeof buf - 1);
+	close(fd);
+	if (len <= 0) return false;
+	buf[len] = '\0';
+	// comm (field 2) may contain spaces and parens, so start after the *last* ')'
+	const char * p = strrchr(buf, ')');
+	if (!p) return false;
+	// fields 3 (state) to 22 (start time)
+	return sscanf(p + 1, " %*c %d %d %d %d %d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+		&st.ppid, &st.pgrp, &st.session, &st.tty_nr, &st.tpgid, &st.start_time) == 6;
+}
+
+unsigned long long process_start_time(pid_t pid) {
+	proc_stat st;
+	return read_proc_stat(pid, st) ? st.start_time : 0;
+}
+
+// the process connector only talks to CAP_NET_ADMIN, and silently ignores everyone else
+static bool have_net_admin() {
+	FILE * status = fopen("/proc/self/status", "re");
+	if (!status) return false;
+	char line[256];
+	unsigned long long caps = 0;
+	while (fgets(line, sizeof line, status))
+		if (sscanf(line, "CapEff: %llx", &caps) == 1) break;
+	fclose(status);
+	return caps >> 12 & 1; // CAP_NET_ADMIN
+}
+
+static int listen_to_process_events() {
+	if (!have_net_admin()) return -1;
+	int fd = socket(PF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+	if (fd < 0) return -1;
+	struct sockaddr_nl addr = {};
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = CN_IDX_PROC;
+	char buf[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))] = {};
+	struct nlmsghdr * hdr = reinterpret_cast<struct nlmsghdr*>(buf);
+	hdr->nlmsg_len = sizeof buf;
+	hdr->nlmsg_type = NLMSG_DONE;
+	hdr->nlmsg_pid = getpid();
+	struct cn_msg * msg = static_cast<struct cn_msg*>(NLMSG_DATA(hdr));
+	msg->id.idx = CN_IDX_PROC;
+	msg->id.val = CN_VAL_PROC;
+	msg->len = sizeof(enum proc_cn_mcast_op);
+	enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+	memcpy(msg->data, &op, sizeof op);
+	if (bind(fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr) || send(fd, buf, sizeof buf, 0) != sizeof buf) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+ProcessTable & ProcessTable::global() {
+	static ProcessTable table;
+	return table;
+}
+
+ProcessTable::ProcessTable() : netlink_fd(listen_to_process_events()), stale(true) {}
+
+ProcessTable::~ProcessTable() {
+	if (netlink_fd >= 0) close(netlink_fd);
+}
+
+void ProcessTable::set_hosts(const std::set<std::string> & paths) {
+	PathIdSet ids;
+	for (const std::string & path : paths)
+		ids.insert(PathTable::global().intern(path));
+	std::lock_guard<std::mutex> lock(mutex);
+	hosts = ids;
+}
+
+bool ProcessTable::is_host(path_id program) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return hosts.contains(program);
+}
+
+void ProcessTable::add(pid_t pid, pid_t ppid) {
+	auto it = parents.find(pid);
+	if (it != parents.end()) {
+		if (it->second == ppid) return;
+		remove(pid);
+	}
+	parents[pid] = ppid;
+	children[ppid].push_back(pid);
+}
+
+void ProcessTable::remove(pid_t pid) {
+	auto it = parents.find(pid);
+	if (it == parents.end()) return;
+	auto siblings = children.find(it->second);
+	if (siblings != children.end()) {
+		siblings->second.erase(std::find(siblings->second.begin(), siblings->second.end(), pid));
+		if (siblings->second.empty()) children.erase(siblings);
+	}
+	parents.erase(it);
+	// its children got reparented; foreground() will notice and fix that when it gets to them
+}
+
+// only reads the stat files of processes that weren't there the last time
+void ProcessTable::scan() {
+	DIR * proc = opendir("/proc");
+	if (!proc) return;
+	std::vector<pid_t> present;
+	present.reserve(parents.size());
+	while (struct dirent * entry = readdir(proc)) {
+		char * end;
+		pid_t pid = strtol(entry->d_name, &end, 10);
+		if (*end || pid <= 0) continue;
+		present.push_back(pid);
+		proc_stat st;
+		if (!parents.count(pid) && read_proc_stat(pid, st))
+			add(pid, st.ppid);
+	}
+	closedir(proc);
+	std::sort(present.begin(), present.end());
+	std::vector<pid_t> gone;
+	for (const std::pair<const pid_t,pid_t> & p : parents)
+		if (!std::binary_search(present.begin(), present.end(), p.first))
+			gone.push_back(p.first);
+	for (pid_t pid : gone)
+		remove(pid);
+	stale = false;
+	last_scan = std::chrono::steady_clock::now();
+}
+
+void ProcessTable::drain_events() {
+	alignas(struct nlmsghdr) char buf[4096];
+	for (;;) {
+		ssize_t len = recv(netlink_fd, buf, sizeof buf, MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == ENOBUFS) { // the kernel dropped some, we'd better look for ourselves
+				stale = true;
+				continue;
+			}
+			if (errno == EINTR) continue;
+			return; // EAGAIN: that's all for now
+		}
+		int left = len;
+		for (struct nlmsghdr * hdr = reinterpret_cast<struct nlmsghdr*>(buf); NLMSG_OK(hdr, left); hdr = NLMSG_NEXT(hdr, left)) {
+			struct cn_msg * msg = static_cast<struct cn_msg*>(NLMSG_DATA(hdr));
+			struct proc_event * ev = reinterpret_cast<struct proc_event*>(msg->data);
+			// threads come and go too, only processes are interesting
+			if (ev->what == proc_event::PROC_EVENT_FORK && ev->event_data.fork.child_pid == ev->event_data.fork.child_tgid)
+				add(ev->event_data.fork.child_tgid, ev->event_data.fork.parent_tgid);
+			else if (ev->what == proc_event::PROC_EVENT_EXIT && ev->event_data.exit.process_pid == ev->event_data.exit.process_tgid)
+				remove(ev->event_data.exit.process_tgid);
+		}
+	}
+}
+
+void ProcessTable::refresh() {
+	if (netlink_fd >= 0) drain_events();
+	if (stale || (netlink_fd < 0 && std::chrono::steady_clock::now() - last_scan >= scan_interval))
+		scan();
+}
+
+pid_t ProcessTable::foreground(pid_t host) {
+	std::lock_guard<std::mutex> lock(mutex);
+	refresh();
+	pid_t best = 0;
+	unsigned long long best_start = 0;
+	level.assign(1, host);
+	for (int depth = 0; depth < max_session_depth && !level.empty(); depth++) {
+		next.clear();
+		for (pid_t parent : level) {
+			auto it = children.find(parent);
+			if (it == children.end()) continue;
+			kids = it->second; // add() and remove() below may change it
+			for (pid_t pid : kids) {
+				proc_stat st;
+				if (!read_proc_stat(pid, st)) { // exited since
+					remove(pid);
+					continue;
+				}
+				if (st.ppid != parent) { // the PID got reused since
+					add(pid, st.ppid);
+					continue;
+				}
+				if (st.session != pid || !st.tty_nr) { // not a shell on a terminal, maybe a step towards one
+					next.push_back(pid);
+					continue;
+				}
+				if (st.tpgid <= 0 || st.tpgid == st.pgrp) continue; // the shell itself is in the foreground: idle
+				// several busy tabs, and no way to tell which one is shown: take the newest job
+				unsigned long long start = process_start_time(st.tpgid);
+				if (start && start >= best_start) {
+					best = st.tpgid;
+					best_start = start;
+				}
+			}
+		}
+		level.swap(next);
+	}
+	return best;
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include <string>
+#include <set>
+#include <vector>
+#include <unordered_map>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <sys/types.h> // pid_t
+#include "path_table.hpp"
+
+/*
+Who runs what inside terminals (Linux-only: /proc, netlink).
+
+A terminal's window belongs to the terminal, but the user works with whatever runs in
+the foreground of the shell it started. For the programs marked as hosts (terminals,
+launchers), foreground() finds the sessions started by the host (descendants that lead
+a session on a tty) and returns the leader of the foreground process group of their
+tty, as told by tpgid.
+
+The parent/child links come from a table kept up to date incrementally: from the
+kernel's fork and exit events if the netlink process connector lets us listen (it
+usually needs CAP_NET_ADMIN), or else by diffing the list of /proc entries every now
+and then, which only reads the stat files of processes it hasn't seen before. Whatever
+the table says is checked against /proc before it's used, so a stale entry can only
+cost a missed session, not a wrong one.
+*/
+
+class ProcessTable {
+public:
+	static ProcessTable & global();
+	// windows of these programs get attributed to their foreground processes
+	void set_hosts(const std::set<std::string> &);
+	bool is_host(path_id) const;
+	// the foreground process of the most recently started busy session of the host, 0 if all are idle
+	pid_t foreground(pid_t host);
+	~ProcessTable();
+
+	ProcessTable(const ProcessTable&) = delete;
+	ProcessTable& operator=(const ProcessTable&) = delete;
+private:
+	ProcessTable();
+	mutable std::mutex mutex; // guards everything
+	PathIdSet hosts;
+	std::unordered_map<pid_t,pid_t> parents;
+	std::unordered_map<pid_t,std::vector<pid_t>> children;
+	int netlink_fd; // -1 if we have to diff /proc instead
+	bool stale; // missed some events, /proc has to be diffed
+	std::chrono::steady_clock::time_point last_scan;
+	std::vector<pid_t> level, next, kids; // foreground()'s, kept so that it stops allocating once they're big enough
+	void refresh();
+	void drain_events();
+	void scan();
+	void add(pid_t pid, pid_t ppid);
+	void remove(pid_t pid);
+};
+
+struct proc_stat {
+	pid_t ppid, pgrp, session;
+	int tty_nr; // 0 if there's no controlling terminal
+	pid_t tpgid; // foreground process group of that terminal
+	unsigned long long start_time; // clock ticks since boot
+};
+
+// fills `st` from /proc/<pid>/stat; false if the process is gone or /proc is unreadable
+bool read_proc_stat(pid_t, proc_stat & st);
+
+/*
+Field 22 of /proc/<pid>/stat (process start time in clock ticks since boot), or 0
+if it can't be read. (pid, start time) uniquely identifies a process even after
+the PID gets reused.
+*/
+unsigned long long process_start_time(pid_t);
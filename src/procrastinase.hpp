@@ -1,6 +1,20 @@
 #pragma once
+#include <chrono>
+#include <cstdint>
+
 enum class ProgramRole {
 	white,
 	grey,
 	black
 };
+
+// which of the watched screens (of which display) something happened on, numbered from 0
+typedef uint16_t seat_id;
+
+// what a program used during an interval, see ResourceSampler
+struct resource_usage {
+	bool sampled; // false: unknown, the rest is 0
+	std::chrono::steady_clock::duration cpu;
+	uint64_t rss; // resident bytes at the end
+	resource_usage() : sampled(false), cpu(0), rss(0) {}
+};
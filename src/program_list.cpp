@@ -0,0 +1,149 @@
+#include "program_list.hpp"
+#include <stdexcept>
+#include <algorithm> // stable_sort
+#include <functional> // hash
+#include <map>
+#include <tuple>
+
+ProgramList::ProgramList(ProgramRole type_) : type(type_) {}
+
+ProgramList::~ProgramList() = default;
+
+ProgramPathSet::ProgramPathSet(ProgramRole type_, const std::set<std::string> & paths_)
+	: ProgramList(type_) {
+	for (const std::string & path : paths_)
+		paths.insert(PathTable::global().intern(path));
+}
+
+bool ProgramPathSet::satisfies(const ForeignWindow & wnd) const {
+	try {
+		return paths.contains(wnd.get_program_id());
+	} catch (std::runtime_error &) { // window owner is a mystery
+		return false;
+	}
+}
+
+WindowTitleSubstringList::WindowTitleSubstringList(ProgramRole type_, const std::list<std::string> & substrings, SubstringMatcher::Mode mode)
+	: ProgramList(type_), title_substrings(substrings, mode) {}
+
+bool WindowTitleSubstringList::satisfies(const ForeignWindow & wnd) const {
+	try {
+		return title_substrings.search(wnd.get_window_title());
+	} catch (std::runtime_error &) { // no title, nothing to match
+		return false;
+	}
+}
+
+ProgramClassifier::ProgramClassifier(size_t cache_size)
+	: current(new rule_set{rules(), false}), pending(nullptr), retired(nullptr),
+	cache(cache_size), cache_hits(0), cache_misses(0) {}
+
+ProgramClassifier::~ProgramClassifier() {
+	delete pending.load();
+	delete retired.load();
+}
+
+// white, grey, black
+static int priority(ProgramRole role) {
+	switch (role) {
+	case ProgramRole::white: return 0;
+	case ProgramRole::grey: return 1;
+	default: return 2;
+	}
+}
+
+void ProgramClassifier::set_rules(rules && new_lists) {
+	std::unique_ptr<rule_set> set(new rule_set{std::move(new_lists), false});
+	std::stable_sort(set->lists.begin(), set->lists.end(), [](const std::unique_ptr<ProgramList> & a, const std::unique_ptr<ProgramList> & b) {
+		return priority(a->type) < priority(b->type);
+	});
+	for (const std::unique_ptr<ProgramList> & list : set->lists)
+		set->titles_matter = set->titles_matter || list->looks_at_title();
+	delete retired.exchange(nullptr, std::memory_order_acquire);
+	// if classify() hasn't picked up the previous rules yet, it never will
+	delete pending.exchange(set.release(), std::memory_order_acq_rel);
+}
+
+ProgramRole ProgramClassifier::evaluate(const ForeignWindow & wnd) const {
+	for (const std::unique_ptr<ProgramList> & list : current->lists)
+		if (list->satisfies(wnd))
+			return list->type;
+	return ProgramRole::grey;
+}
+
+ProgramRole ProgramClassifier::classify(const ForeignWindow & wnd) {
+	if (pending.load(std::memory_order_relaxed)) {
+		if (rule_set * fresh = pending.exchange(nullptr, std::memory_order_acquire)) {
+			// normally there's nothing retired left by now, and set_rules() will free these
+			delete retired.exchange(current.release(), std::memory_order_acq_rel);
+			current.reset(fresh);
+			cache.clear();
+		}
+	}
+	key k {PathTable::no_path, 0};
+	try {
+		k.program = wnd.get_program_id();
+	} catch (std::runtime_error &) {} // window owner is a mystery, it's all in the title then
+	if (current->titles_matter) try {
+		k.title_hash = std::hash<std::string>()(wnd.get_window_title());
+	} catch (std::runtime_error &) {}
+	if (ProgramRole * cached = cache.find(k)) {
+		cache_hits++;
+		return *cached;
+	}
+	cache_misses++;
+	return cache.insert(k, evaluate(wnd));
+}
+
+ProgramClassifier::rules read_rules(std::istream & in) {
+	static const struct { const char * name; ProgramRole role; } roles[] = {
+		{"white", ProgramRole::white}, {"grey", ProgramRole::grey}, {"black", ProgramRole::black}
+	};
+	static const struct { const char * name; SubstringMatcher::Mode mode; } title_kinds[] = {
+		{"title", SubstringMatcher::Mode::exact},
+		{"title-ascii", SubstringMatcher::Mode::ascii_case_insensitive},
+		{"title-nocase", SubstringMatcher::Mode::utf8_case_insensitive}
+	};
+	std::map<ProgramRole,std::set<std::string>> paths;
+	std::map<std::tuple<ProgramRole,SubstringMatcher::Mode>,std::list<std::string>> titles;
+	std::string line;
+	for (size_t number = 1; std::getline(in, line); number++) {
+		std::string where = "line " + std::to_string(number) + ": ";
+		size_t role_start = line.find_first_not_of(" \t\r");
+		if (role_start == std::string::npos || line[role_start] == '#') continue;
+		size_t role_end = line.find_first_of(" \t", role_start);
+		size_t kind_start = line.find_first_not_of(" \t", role_end);
+		size_t kind_end = line.find_first_of(" \t", kind_start);
+		size_t value_start = line.find_first_not_of(" \t\r", kind_end);
+		if (value_start == std::string::npos)
+			throw std::runtime_error(where + "expected a role, a kind and a value");
+		std::string role_name = line.substr(role_start, role_end - role_start);
+		std::string kind = line.substr(kind_start, kind_end - kind_start);
+		std::string value = line.substr(value_start);
+		value.erase(value.find_last_not_of(" \t\r") + 1);
+
+		const ProgramRole * role = nullptr;
+		for (const auto & r : roles)
+			if (role_name == r.name) role = &r.role;
+		if (!role)
+			throw std::runtime_error(where + "unknown role " + role_name);
+		if (kind == "program") {
+			paths[*role].insert(value);
+			continue;
+		}
+		const SubstringMatcher::Mode * mode = nullptr;
+		for (const auto & k : title_kinds)
+			if (kind == k.name) mode = &k.mode;
+		if (!mode)
+			throw std::runtime_error(where + "unknown kind " + kind);
+		titles[std::make_tuple(*role, *mode)].push_back(value);
+	}
+	if (in.bad()) throw std::runtime_error("can't read the rules");
+	ProgramClassifier::rules ret;
+	// within a role the order doesn't change the outcome, and programs are cheaper to check
+	for (const auto & p : paths)
+		ret.emplace_back(new ProgramPathSet(p.first, p.second));
+	for (const auto & t : titles)
+		ret.emplace_back(new WindowTitleSubstringList(std::get<0>(t.first), t.second, std::get<1>(t.first)));
+	return ret;
+}
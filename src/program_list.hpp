@@ -1,28 +1,110 @@
+#pragma once
 #include "foreign_window.hpp"
 #include "procrastinase.hpp"
+#include "substring_matcher.hpp"
+#include "path_table.hpp"
 #include <string>
 #include <set>
 #include <list>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <istream>
+#include <cstdint>
+#include "lru_cache.hpp"
 
+// immutable once constructed, so one thread may build them while another one matches
 class ProgramList {
 public:
 	const ProgramRole type;
-	virtual bool satisfies(const ForeignWindow&) = 0;
+	ProgramList(ProgramRole);
+	virtual bool satisfies(const ForeignWindow&) const = 0;
+	// false if satisfies() only depends on the program, so the title can be left out of cache keys
+	virtual bool looks_at_title() const { return false; }
 	virtual ~ProgramList();
 };
 
 class ProgramPathSet : public ProgramList {
 public:
-	ProgramPathSet(const std::set<std::string>&);
-	bool satisfies(const ForeignWindow&) override;
+	ProgramPathSet(ProgramRole, const std::set<std::string>&);
+	bool satisfies(const ForeignWindow&) const override;
+	bool contains(path_id id) const { return paths.contains(id); }
 private:
-	std::set<std::string> paths;
+	PathIdSet paths; // interned through PathTable::global()
 };
 
 class WindowTitleSubstringList : public ProgramList {
 public:
-	WindowTitleSubstringList(const std::list<std::string>&);
-	bool satisfies(const ForeignWindow&) override;
+	// titles come from _NET_WM_NAME, which is UTF-8
+	WindowTitleSubstringList(ProgramRole, const std::list<std::string>&, SubstringMatcher::Mode = SubstringMatcher::Mode::exact);
+	bool satisfies(const ForeignWindow&) const override;
+	bool looks_at_title() const override { return true; }
 private:
-	std::list<std::string> title_substrings;
+	SubstringMatcher title_substrings; // all the substrings compiled into one automaton
 };
+
+/*
+Decides the role of a window: the first list it satisfies wins, white lists before
+grey ones before black ones (in the order given within a role), grey if none.
+
+Focus keeps going back and forth between the same windows, so the results are
+remembered per (program, title hash) in an LRU. Titles only go into the key when
+some list looks at them, and a 64-bit hash collision costs a misclassified title,
+not correctness of anything else.
+
+classify() is for one thread only, set_rules() may be called from any other one.
+The new rules get sorted there and handed over as a whole by swapping a pointer;
+classify() picks them up on its next call (and forgets the cached results), so the
+thread classifying never waits for rules being built, however big. Rules it has
+stopped using are freed by the next set_rules(), not by classify().
+*/
+class ProgramClassifier {
+public:
+	typedef std::vector<std::unique_ptr<ProgramList>> rules;
+	explicit ProgramClassifier(size_t cache_size = 4096);
+	void set_rules(rules &&);
+	ProgramRole classify(const ForeignWindow &);
+	uint64_t hits() const { return cache_hits; }
+	uint64_t misses() const { return cache_misses; }
+	~ProgramClassifier();
+
+	ProgramClassifier(const ProgramClassifier&) = delete;
+	ProgramClassifier& operator=(const ProgramClassifier&) = delete;
+private:
+	struct rule_set {
+		rules lists; // by priority
+		bool titles_matter;
+	};
+	struct key {
+		path_id program;
+		uint64_t title_hash;
+		bool operator ==(const key & other) const {
+			return program == other.program && title_hash == other.title_hash;
+		}
+	};
+	struct key_hash {
+		size_t operator()(const key & k) const {
+			return k.title_hash * 31 ^ k.program;
+		}
+	};
+	std::unique_ptr<rule_set> current; // only touched by classify()
+	std::atomic<rule_set*> pending; // published, not picked up yet
+	std::atomic<rule_set*> retired; // picked up and replaced since
+	lru_cache<key,ProgramRole,key_hash> cache;
+	std::atomic<uint64_t> cache_hits, cache_misses;
+	ProgramRole evaluate(const ForeignWindow &) const;
+};
+
+/*
+Reads rules from a text file, one per line; empty lines and lines starting with #
+are skipped. Every rule is a role (white, grey, black), a kind and a value:
+	black program /usr/bin/steam
+	white title Procrastinase manual
+	black title-nocase youtube
+The value is the rest of the line. `program` takes a full executable path,
+`title` a substring of window titles; `title-ascii` and `title-nocase` match
+titles ignoring ASCII and UTF-8 case (see SubstringMatcher::Mode).
+Everything of one role, kind and mode becomes one ProgramList, so a thousand
+titles are still a single automaton. Throws runtime_error naming the bad line.
+*/
+ProgramClassifier::rules read_rules(std::istream &);
@@ -1,8 +1,23 @@
+#pragma once
 #include <mutex>
 #include <condition_variable>
 #include <queue>
 #include <utility>
 #include <stdexcept>
+#include <atomic>
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+#include <new> // placement new
+#include <type_traits> // aligned_storage
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <climits>
+#include <ctime> // timespec
+#endif
 
 struct thr_finished : public std::runtime_error {
 	thr_finished() : std::runtime_error("thr_queue finished") {}
@@ -54,8 +69,257 @@ public:
 		return ret;
 	}
 
+	// waits for at least one element, then feeds f(elt&&) everything queued so far
+	template <typename F>
+	size_t pop_all(F f) {
+		std::queue<elt> taken;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (queue.empty() && !finished) cv.wait(lock);
+			if (finished) throw thr_finished();
+			taken.swap(queue);
+		}
+		size_t count = taken.size();
+		for (; !taken.empty(); taken.pop())
+			f(std::move(taken.front()));
+		return count;
+	}
+
 	// should be referenced, not copied
 	// use std::ref when creating std::thread
 	thr_queue(const thr_queue&) = delete;
 	thr_queue& operator=(const thr_queue&) = delete;
 };
+
+/*
+Lets one thread sleep until another one changes something it's interested in.
+Notifying is a single atomic load unless the other thread is actually asleep.
+On Linux, sleeping is done directly on a futex.
+*/
+class thr_waiter {
+private:
+	std::atomic<uint32_t> seq;
+	std::atomic<bool> sleeping;
+#ifndef __linux__
+	std::mutex mutex;
+	std::condition_variable cv;
+#endif
+public:
+	thr_waiter() : seq(0), sleeping(false) {}
+
+	template <typename P>
+	void wait_until(P ready) {
+		// the other thread is often just about to deliver, give it a chance before going to sleep
+		for (int spins = 0; spins < 64; spins++)
+			if (ready()) return;
+		while (!ready()) {
+			uint32_t s = seq.load(std::memory_order_acquire);
+			sleeping.store(true, std::memory_order_relaxed);
+			// pairs with the fence in notify(): either we see the change or they see us sleeping
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (ready()) break;
+#ifdef __linux__
+			// returns at once if seq has changed since we've read it
+			syscall(SYS_futex, reinterpret_cast<uint32_t*>(&seq), FUTEX_WAIT_PRIVATE, s, nullptr, nullptr, 0);
+#else
+			std::unique_lock<std::mutex> lock(mutex);
+			while (seq.load(std::memory_order_acquire) == s) cv.wait(lock);
+#endif
+		}
+		sleeping.store(false, std::memory_order_relaxed);
+	}
+
+	// same, but gives up at the deadline; returns whether it's ready
+	template <typename P>
+	bool wait_until(P ready, std::chrono::steady_clock::time_point deadline) {
+		if (deadline == std::chrono::steady_clock::time_point::max()) {
+			wait_until(ready);
+			return true;
+		}
+		bool ret;
+		while (!(ret = ready())) {
+			std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			if (now >= deadline) break;
+			uint32_t s = seq.load(std::memory_order_acquire);
+			sleeping.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if ((ret = ready())) break;
+#ifdef __linux__
+			// FUTEX_WAIT's timeout is relative, and measured on CLOCK_MONOTONIC like steady_clock
+			std::chrono::nanoseconds left = deadline - now;
+			struct timespec timeout = {
+				time_t(std::chrono::duration_cast<std::chrono::seconds>(left).count()),
+				long((left % std::chrono::seconds(1)).count())
+			};
+			syscall(SYS_futex, reinterpret_cast<uint32_t*>(&seq), FUTEX_WAIT_PRIVATE, s, &timeout, nullptr, 0);
+#else
+			std::unique_lock<std::mutex> lock(mutex);
+			while (seq.load(std::memory_order_acquire) == s)
+				if (cv.wait_until(lock, deadline) == std::cv_status::timeout) break;
+#endif
+		}
+		sleeping.store(false, std::memory_order_relaxed);
+		return ret;
+	}
+
+	void notify() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		// only the first notification after falling asleep has to wake anybody up:
+		// the sleeper sets the flag again if it has to go back to sleep
+		if (!sleeping.load(std::memory_order_relaxed) || !sleeping.exchange(false, std::memory_order_relaxed)) return;
+#ifdef __linux__
+		seq.fetch_add(1, std::memory_order_release);
+		syscall(SYS_futex, reinterpret_cast<uint32_t*>(&seq), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#else
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			seq.fetch_add(1, std::memory_order_release);
+		}
+		cv.notify_all();
+#endif
+	}
+
+	thr_waiter(const thr_waiter&) = delete;
+	thr_waiter& operator=(const thr_waiter&) = delete;
+};
+
+/*
+Bounded lock-free ring for exactly one producer thread and one consumer thread.
+Same interface and finish() semantics as thr_queue; pushing to a full ring
+waits for the consumer to catch up. Capacity is rounded up to a power of two.
+*/
+template <typename elt>
+class spsc_queue {
+private:
+	typedef typename std::aligned_storage<sizeof(elt), alignof(elt)>::type slot;
+	std::vector<slot> ring;
+	size_t mask;
+	// keep the indices on separate cache lines, they're written by different threads
+	char pad0[64];
+	std::atomic<size_t> head; // next element to pop, written by consumer
+	char pad1[64];
+	std::atomic<size_t> tail; // next free slot, written by producer
+	char pad2[64];
+	std::atomic<bool> finished;
+	thr_waiter not_empty, not_full;
+
+	elt * at(size_t i) {
+		return reinterpret_cast<elt*>(&ring[i & mask]);
+	}
+
+	template <typename T>
+	void push_impl(T && element) {
+		size_t t = tail.load(std::memory_order_relaxed);
+		not_full.wait_until([this, t] {
+			return t - head.load(std::memory_order_acquire) <= mask
+				|| finished.load(std::memory_order_acquire);
+		});
+		if (finished.load(std::memory_order_acquire)) throw thr_finished();
+		new (at(t)) elt(std::forward<T>(element));
+		tail.store(t + 1, std::memory_order_release);
+		not_empty.notify();
+	}
+
+	// waits until there's something to pop, returns the first index not to pop
+	size_t wait_nonempty(size_t h) {
+		size_t t;
+		not_empty.wait_until([this, h, &t] {
+			t = tail.load(std::memory_order_acquire);
+			return t != h || finished.load(std::memory_order_acquire);
+		});
+		if (finished.load(std::memory_order_acquire)) throw thr_finished();
+		return t;
+	}
+
+	template <typename F>
+	size_t pop_range(size_t h, size_t t, F & f) {
+		for (size_t i = h; i != t; i++) {
+			elt e(std::move(*at(i)));
+			at(i)->~elt();
+			// free the slot before f() gets a chance to throw; the producer may be waiting for it, too
+			head.store(i + 1, std::memory_order_release);
+			not_full.notify();
+			f(std::move(e));
+		}
+		return t - h;
+	}
+public:
+	explicit spsc_queue(size_t capacity = 1024) : head(0), tail(0), finished(false) {
+		size_t size = 1;
+		while (size < capacity) size <<= 1;
+		ring.resize(size);
+		mask = size - 1;
+	}
+
+	void push(const elt & element) { // creates a copy of existing object
+		push_impl(element);
+	}
+
+	void push(elt && element) { // moves temp objects
+		push_impl(std::move(element));
+	}
+
+	// exact only when called by the producer or the consumer, and only for that moment
+	bool empty() const {
+		return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+	}
+
+	/*
+	For the producer: sleeps until the consumer has taken everything (or finish()).
+	thr_waiter only wakes a sleeper on the first notification after it fell asleep, so
+	when pop_all() drains a batch, only its first pop may wake us. That's enough because
+	every pop stores head before it notifies, and wait_until() checks again after setting
+	its flag and before sleeping: a pop we miss while awake is one we see then.
+	Keep both true, or this sleeps forever (see the queue check in tests/checks.cpp).
+	*/
+	void wait_empty() {
+		not_full.wait_until([this] {
+			return empty() || finished.load(std::memory_order_acquire);
+		});
+	}
+
+	void finish() {
+		finished.store(true, std::memory_order_release);
+		not_empty.notify();
+		not_full.notify();
+	}
+
+	elt pop() {
+		size_t h = head.load(std::memory_order_relaxed);
+		wait_nonempty(h);
+		elt ret(std::move(*at(h)));
+		at(h)->~elt();
+		head.store(h + 1, std::memory_order_release);
+		not_full.notify();
+		return ret;
+	}
+
+	// waits for at least one element, then feeds f(elt&&) everything queued so far
+	template <typename F>
+	size_t pop_all(F f) {
+		size_t h = head.load(std::memory_order_relaxed);
+		return pop_range(h, wait_nonempty(h), f);
+	}
+
+	// same, but returns 0 if nothing came until the deadline
+	template <typename F>
+	size_t pop_all_until(std::chrono::steady_clock::time_point deadline, F f) {
+		size_t h = head.load(std::memory_order_relaxed), t = h;
+		not_empty.wait_until([this, h, &t] {
+			t = tail.load(std::memory_order_acquire);
+			return t != h || finished.load(std::memory_order_acquire);
+		}, deadline);
+		if (finished.load(std::memory_order_acquire)) throw thr_finished();
+		return pop_range(h, t, f);
+	}
+
+	~spsc_queue() {
+		for (size_t i = head.load(), t = tail.load(); i != t; i++)
+			at(i)->~elt();
+	}
+
+	// should be referenced, not copied
+	// use std::ref when creating std::thread
+	spsc_queue(const spsc_queue&) = delete;
+	spsc_queue& operator=(const spsc_queue&) = delete;
+};
@@ -0,0 +1,175 @@
+#include "reactor.hpp"
+#include <stdexcept>
+#include <cerrno>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <unistd.h> // read, close
+#include <pthread.h> // pthread_sigmask
+
+Reactor::Reactor()
+	: epoll_fd(-1), timer_fd(-1), signal_fd(-1), stopping(false), last_timer_id(0),
+	dispatching(-1), dispatching_removed(false) {
+	sigemptyset(&signals);
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) throw std::runtime_error("epoll_create1 returned error");
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		close(epoll_fd);
+		throw std::runtime_error("timerfd_create returned error");
+	}
+	try {
+		watch(timer_fd);
+	} catch (...) {
+		close(timer_fd);
+		close(epoll_fd);
+		throw;
+	}
+}
+
+Reactor::~Reactor() {
+	if (signal_fd >= 0) close(signal_fd);
+	close(timer_fd);
+	close(epoll_fd);
+}
+
+void Reactor::watch(int fd) {
+	struct epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev))
+		throw std::runtime_error("epoll_ctl returned error");
+}
+
+void Reactor::add_fd(int fd, std::function<void()> on_readable) {
+	watch(fd);
+	fds[fd] = std::move(on_readable);
+}
+
+void Reactor::remove_fd(int fd) {
+	auto it = fds.find(fd);
+	if (it == fds.end()) return;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+	if (fd == dispatching)
+		dispatching_removed = true; // the callback is running, erase it once it returns
+	else
+		fds.erase(it);
+}
+
+Reactor::timer Reactor::add_abs(clock::time_point when, std::function<void()> cb) {
+	timer ret {when, ++last_timer_id};
+	timers.insert({{when, ret.id}, std::move(cb)});
+	arm_timer();
+	return ret;
+}
+
+void Reactor::cancel(timer & t) {
+	if (!t) return;
+	timers.erase({t.when, t.id});
+	t.id = 0;
+	// if it was the earliest one, the timerfd goes off for nothing and gets rearmed then
+}
+
+// points the timerfd at the earliest deadline, unless it's already there
+void Reactor::arm_timer() {
+	clock::time_point next = timers.empty() ? clock::time_point() : timers.begin()->first.first;
+	if (next == armed) return;
+	struct itimerspec spec = {};
+	if (!timers.empty()) {
+		std::chrono::nanoseconds ns = std::chrono::duration_cast<std::chrono::nanoseconds>(next.time_since_epoch());
+		spec.it_value.tv_sec = ns.count() / 1000000000;
+		spec.it_value.tv_nsec = ns.count() % 1000000000;
+		if (!spec.it_value.tv_sec && !spec.it_value.tv_nsec)
+			spec.it_value.tv_nsec = 1; // all zeroes would disarm it
+	}
+	if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr))
+		throw std::runtime_error("timerfd_settime returned error");
+	armed = next;
+}
+
+void Reactor::fire_timers() {
+	uint64_t expirations;
+	while (read(timer_fd, &expirations, sizeof expirations) > 0) {}
+	armed = clock::time_point();
+	/*
+	One at a time, straight from the map: a callback may cancel a timer due in the same
+	batch, which mustn't fire then. Timers added by the callbacks wait for the next
+	round, even if they're due already, so that a timer re-adding itself can't starve
+	everything else.
+	*/
+	clock::time_point now = clock::now();
+	uint64_t last = last_timer_id;
+	try {
+		for (auto it = timers.begin(); it != timers.end() && it->first.first <= now;) {
+			if (it->first.second > last) {
+				++it;
+				continue;
+			}
+			std::function<void()> cb = std::move(it->second);
+			timers.erase(it);
+			cb();
+			it = timers.begin(); // the callback may have changed anything
+		}
+	} catch (...) {
+		arm_timer();
+		throw;
+	}
+	arm_timer();
+}
+
+void Reactor::on_signal(int sig, std::function<void()> handler) {
+	sigaddset(&signals, sig);
+	if (pthread_sigmask(SIG_BLOCK, &signals, nullptr))
+		throw std::runtime_error("pthread_sigmask returned error");
+	// on an existing signalfd, this just updates the set of signals
+	int fd = signalfd(signal_fd, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd < 0) throw std::runtime_error("signalfd returned error");
+	if (signal_fd < 0) {
+		signal_fd = fd;
+		watch(signal_fd);
+	}
+	signal_handlers[sig] = std::move(handler);
+}
+
+void Reactor::handle_signals() {
+	struct signalfd_siginfo info;
+	while (read(signal_fd, &info, sizeof info) == sizeof info) {
+		auto it = signal_handlers.find(info.ssi_signo);
+		if (it != signal_handlers.end()) it->second();
+	}
+}
+
+void Reactor::run() {
+	stopping = false;
+	struct epoll_event events[16];
+	while (!stopping) {
+		int n = epoll_wait(epoll_fd, events, sizeof events / sizeof *events, -1);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			throw std::runtime_error("epoll_wait returned error");
+		}
+		for (int i = 0; i < n && !stopping; i++) {
+			int fd = events[i].data.fd;
+			if (fd == timer_fd) {
+				fire_timers();
+			} else if (fd == signal_fd) {
+				handle_signals();
+			} else {
+				// the callback of an earlier event may have removed this one
+				auto it = fds.find(fd);
+				if (it == fds.end()) continue;
+				dispatching = fd;
+				dispatching_removed = false;
+				try {
+					it->second();
+				} catch (...) {
+					dispatching = -1;
+					if (dispatching_removed) fds.erase(fd);
+					throw;
+				}
+				dispatching = -1;
+				if (dispatching_removed) fds.erase(fd);
+			}
+		}
+	}
+}
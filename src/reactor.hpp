@@ -0,0 +1,74 @@
+#pragma once
+#include <chrono>
+#include <functional>
+#include <map>
+#include <unordered_map>
+#include <utility>
+#include <cstdint>
+#include <signal.h> // sigset_t
+
+/*
+Single-threaded event loop (Linux-only: epoll, timerfd, signalfd). File descriptors,
+timers and signals all wake the same epoll_wait(), and every callback runs on the
+thread calling run(), so nothing has to be handed over to another thread.
+
+Usage:
+
+1) Create a Reactor; register readable file descriptors with add_fd, timers with
+add_rel/add_abs (cancel them with cancel), and signals with on_signal.
+2) Call run(); it returns after a callback calls stop(). An exception thrown by a callback
+leaves run() too.
+
+Signals are delivered to a signalfd only when they are blocked in every thread, so
+on_signal blocks them in the calling thread: call it before starting any other thread,
+or block the signals in main() before that.
+*/
+
+class Reactor {
+public:
+	typedef std::chrono::steady_clock clock; // CLOCK_MONOTONIC, like the timerfd
+	class timer {
+	private:
+		friend class Reactor;
+		clock::time_point when;
+		uint64_t id; // 0 means dead
+		timer(clock::time_point when_, uint64_t id_) : when(when_), id(id_) {}
+	public:
+		timer() : id(0) {}
+		operator bool() const {
+			return id;
+		}
+	};
+
+	Reactor();
+	~Reactor();
+	void add_fd(int fd, std::function<void()> on_readable);
+	void remove_fd(int fd);
+	timer add_rel(clock::duration diff, std::function<void()> cb) {
+		return add_abs(clock::now() + diff, std::move(cb));
+	}
+	timer add_abs(clock::time_point, std::function<void()>);
+	void cancel(timer &); // no-op for a dead or already fired timer
+	void on_signal(int sig, std::function<void()>);
+	void run();
+	void stop() { stopping = true; }
+
+	Reactor(const Reactor&) = delete;
+	Reactor& operator=(const Reactor&) = delete;
+private:
+	int epoll_fd, timer_fd, signal_fd;
+	sigset_t signals;
+	bool stopping;
+	uint64_t last_timer_id;
+	std::unordered_map<int,std::function<void()>> fds;
+	// ordered by deadline; the ID keeps timers with equal deadlines apart
+	std::map<std::pair<clock::time_point,uint64_t>,std::function<void()>> timers;
+	std::unordered_map<int,std::function<void()>> signal_handlers;
+	clock::time_point armed; // the timerfd's deadline, or the epoch if disarmed
+	int dispatching; // whose callback is running, so that it could remove itself
+	bool dispatching_removed;
+	void watch(int fd);
+	void arm_timer();
+	void fire_timers();
+	void handle_signals();
+};
@@ -0,0 +1,43 @@
+#include "window_watcher.hpp"
+#include <iostream>
+
+int main(int argc, char ** argv) {
+	bool single_threaded = argc > 2 && std::string(argv[argc-1]) == "--reactor";
+	if (single_threaded) argc--;
+	if (argc < 2 || argc > 3) {
+		std::cerr << "Usage: " << argv[0] << " TRACE [realtime|fast|simulated] [--reactor]" << std::endl;
+		return 2;
+	}
+	ReplaySource source {argv[1], ReplaySource::Speed::realtime};
+	if (argc > 2) {
+		std::string speed = argv[2];
+		if (speed == "fast") {
+			source.speed = ReplaySource::Speed::fast;
+		} else if (speed == "simulated") {
+			source.speed = ReplaySource::Speed::simulated;
+		} else if (speed != "realtime") {
+			std::cerr << "Unknown speed: " << speed << std::endl;
+			return 2;
+		}
+	}
+
+	std::set<std::string> whitelist = {"/usr/bin/stterm"}; // same as skeleton
+
+	Statistics stat;
+
+	WindowWatcher ww(stat, source);
+	ww.set_whitelist(whitelist);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	if (single_threaded) {
+		Reactor reactor;
+		ww.run(reactor);
+	} else {
+		ww.run();
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	uint64_t events = ww.counters().events;
+	std::cerr << events << " events in " << seconds << " s (" << events / seconds << " events/s)" << std::endl;
+	ww.dump_stats(std::cerr);
+	return 0;
+}
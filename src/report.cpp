@@ -0,0 +1,69 @@
+#include "usage_report.hpp"
+#include <iostream>
+#include <cstdio> // sscanf
+#include <cstdlib> // atoi
+#include <ctime> // mktime
+
+static const char * role_name(ProgramRole role) {
+	switch (role) {
+	case ProgramRole::white: return "white";
+	case ProgramRole::black: return "black";
+	default: return "grey";
+	}
+}
+
+// local midnight of YYYY-MM-DD
+static bool parse_date(const char * s, UsageReport::time_point & ret) {
+	struct tm t = {};
+	if (sscanf(s, "%d-%d-%d", &t.tm_year, &t.tm_mon, &t.tm_mday) != 3) return false;
+	t.tm_year -= 1900;
+	t.tm_mon -= 1;
+	t.tm_isdst = -1;
+	time_t time = mktime(&t);
+	if (time == (time_t)-1) return false;
+	ret = std::chrono::system_clock::from_time_t(time);
+	return true;
+}
+
+static void print_rows(const char * log, const std::vector<UsageReport::row> & rows) {
+	for (const UsageReport::row & r : rows) {
+		if (log) std::cout << log << '\t';
+		std::cout << r.program << '\t' << role_name(r.role) << '\t' << r.total.count() / 1e6 << '\n';
+	}
+}
+
+int main(int argc, char ** argv) try {
+	UsageReport report;
+	UsageReport::time_point from = UsageReport::time_point::min(), to = UsageReport::time_point::max();
+	bool per_log = false, usage = false;
+	std::vector<std::string> logs;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (i + 1 < argc && arg == "--from" && parse_date(argv[i+1], from)) i++;
+		else if (i + 1 < argc && arg == "--to" && parse_date(argv[i+1], to)) i++;
+		else if (i + 1 < argc && arg == "--threads") report.set_threads(atoi(argv[++i]));
+		else if (arg == "--per-log") per_log = true;
+		else if (arg.compare(0, 2, "--")) logs.push_back(arg);
+		else usage = true;
+	}
+	if (usage || logs.empty()) {
+		std::cerr << "Usage: " << argv[0] << " [--from YYYY-MM-DD] [--to YYYY-MM-DD] [--threads N] [--per-log] LOG..." << std::endl
+			<< "Prints program, role and seconds per line, most used first; --per-log also prints" << std::endl
+			<< "every log's own lines, prefixed with its path, as soon as it's done." << std::endl;
+		return 2;
+	}
+	report.set_range(from, to);
+
+	UsageReport::log_callback print_log;
+	if (per_log)
+		print_log = [](const std::string & path, std::vector<UsageReport::row> && rows) {
+			print_rows(path.c_str(), rows);
+			std::cout << std::flush;
+		};
+	std::vector<UsageReport::row> totals = report.run(logs, print_log);
+	print_rows(per_log ? "*" : nullptr, totals);
+	return 0;
+} catch (std::exception & e) {
+	std::cerr << e.what() << std::endl;
+	return 1;
+}
@@ -0,0 +1,106 @@
+#include "resource_sampler.hpp"
+#include <cstdio> // snprintf, sscanf
+#include <cstring> // strrchr
+#include <fcntl.h>
+#include <unistd.h> // pread, close, sysconf
+
+// two file descriptors each; more processes than that aren't "lately" anymore
+static const size_t max_processes = 32;
+
+ResourceSampler::ResourceSampler()
+	: uses(0), tick_ns(1000000000 / sysconf(_SC_CLK_TCK)), page_size(sysconf(_SC_PAGESIZE)) {}
+
+ResourceSampler::~ResourceSampler() {
+	for (process & p : processes)
+		close_process(p);
+}
+
+void ResourceSampler::close_process(process & p) {
+	close(p.stat_fd);
+	close(p.statm_fd);
+}
+
+// opens the files if they aren't yet; nullptr if the process is gone
+ResourceSampler::process * ResourceSampler::find(pid_t pid) {
+	for (process & p : processes) {
+		if (p.pid != pid) continue;
+		p.last_used = uses;
+		return &p;
+	}
+	char name[32];
+	snprintf(name, sizeof name, "/proc/%d/stat", (int)pid);
+	int stat_fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (stat_fd < 0) return nullptr;
+	snprintf(name, sizeof name, "/proc/%d/statm", (int)pid);
+	int statm_fd = open(name, O_RDONLY | O_CLOEXEC);
+	if (statm_fd < 0) {
+		close(stat_fd);
+		return nullptr;
+	}
+	process * slot;
+	if (processes.size() < max_processes) {
+		processes.push_back({});
+		slot = &processes.back();
+	} else {
+		slot = &processes[0];
+		for (process & p : processes)
+			if (p.last_used < slot->last_used) slot = &p;
+		close_process(*slot);
+	}
+	*slot = {pid, stat_fd, statm_fd, 0, uses};
+	return slot;
+}
+
+// false if the process is gone, and then it's forgotten: `p` is no longer valid
+bool ResourceSampler::read(process & p, sample & s) {
+	char stat[1024], statm[256];
+	ssize_t stat_len = pread(p.stat_fd, stat, sizeof stat - 1, 0);
+	ssize_t statm_len = stat_len > 0 ? pread(p.statm_fd, statm, sizeof statm - 1, 0) : -1;
+	bool ok = stat_len > 0 && statm_len > 0;
+	if (ok) {
+		stat[stat_len] = statm[statm_len] = '\0';
+		// comm (field 2) may contain spaces and parens, so start after the *last* ')'
+		const char * fields = strrchr(stat, ')');
+		unsigned long long utime, stime, resident;
+		// fields 14 (utime), 15 (stime) and 22 (start time) of stat, 2 (resident pages) of statm
+		ok = fields && sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d %*d %*d %*d %*d %llu",
+			&utime, &stime, &p.start_time) == 3
+			&& sscanf(statm, "%*u %llu", &resident) == 1;
+		s.cpu_ticks = ok ? utime + stime : 0;
+		s.rss = ok ? resident * page_size : 0;
+	}
+	if (!ok) {
+		close_process(p);
+		p = processes.back();
+		processes.pop_back();
+	}
+	return ok;
+}
+
+resource_usage ResourceSampler::boundary(seat_id seat, pid_t pid) {
+	if (seat >= seats.size()) seats.resize(seat + 1);
+	seat_state & s = seats[seat];
+	resource_usage ret;
+	uses++;
+	if (s.pid) {
+		process * p = find(s.pid);
+		sample now;
+		// a reopened PID may belong to another process by now
+		if (p && read(*p, now) && p->start_time == s.start_time) {
+			ret.sampled = true;
+			ret.cpu = std::chrono::nanoseconds((now.cpu_ticks - s.start.cpu_ticks) * tick_ns);
+			ret.rss = now.rss;
+			if (pid == s.pid) { // it goes on: the same read starts the next interval
+				s.start = now;
+				return ret;
+			}
+		}
+	}
+	s.pid = 0;
+	process * p;
+	if (pid > 0 && (p = find(pid)) && read(*p, s.start)) {
+		s.pid = pid;
+		s.start_time = p->start_time;
+	}
+	return ret;
+}
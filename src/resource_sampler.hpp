@@ -0,0 +1,55 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <sys/types.h> // pid_t
+#include "procrastinase.hpp"
+
+/*
+What the focused process of every seat costs while it's focused: CPU time and
+resident memory per interval (Linux-only: /proc).
+
+The stat and statm files of the processes focused lately stay open, and every
+interval boundary reads the process whose interval ends and the one whose
+interval starts (often the same one) with pread(), a few microseconds each, so
+even frantic focus switching costs nothing to speak of. An open /proc/<pid>
+file keeps referring to the process it was opened for, so reading it can't
+pick up a different process that got the PID later: it just fails.
+
+CPU time comes in clock ticks (usually 10 ms), so short intervals often get 0,
+but the sums are right.
+*/
+
+class ResourceSampler {
+public:
+	ResourceSampler();
+	~ResourceSampler();
+	// ends the seat's current interval, returning what its process used, and starts the next one, for `pid` (0 if none)
+	resource_usage boundary(seat_id, pid_t);
+
+	ResourceSampler(const ResourceSampler&) = delete;
+	ResourceSampler& operator=(const ResourceSampler&) = delete;
+private:
+	struct process {
+		pid_t pid;
+		int stat_fd, statm_fd;
+		unsigned long long start_time; // tells a reopened PID from the process it was
+		uint64_t last_used;
+	};
+	struct sample {
+		unsigned long long cpu_ticks; // user + system
+		uint64_t rss; // bytes
+	};
+	struct seat_state {
+		pid_t pid; // 0: nothing sampled
+		unsigned long long start_time;
+		sample start;
+		seat_state() : pid(0), start_time(0), start() {}
+	};
+	std::vector<process> processes; // few, so searched linearly; least recently used gets closed
+	std::vector<seat_state> seats;
+	uint64_t uses;
+	long tick_ns, page_size;
+	process * find(pid_t);
+	bool read(process &, sample &);
+	void close_process(process &);
+};
@@ -0,0 +1,205 @@
+#include "rollup_store.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <ctime>
+
+static int64_t local_hour_start(int64_t t, int * hour_of_week = nullptr) {
+	time_t tt = t;
+	struct tm local;
+	localtime_r(&tt, &local);
+	if (hour_of_week) *hour_of_week = local.tm_wday * 24 + local.tm_hour;
+	return t - local.tm_min * 60 - local.tm_sec; // DST shifts are whole hours, so this is exact
+}
+
+static int64_t local_day_start(int64_t t) {
+	time_t tt = t;
+	struct tm local;
+	localtime_r(&tt, &local);
+	local.tm_hour = local.tm_min = local.tm_sec = 0;
+	local.tm_isdst = -1; // let mktime figure it out
+	return mktime(&local);
+}
+
+static int64_t seconds(RollupStore::time_point t) {
+	return std::chrono::duration_cast<std::chrono::seconds>(t.time_since_epoch()).count();
+}
+
+static RollupStore::time_point from_seconds(int64_t t) {
+	return RollupStore::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::seconds(t)));
+}
+
+static void put_varint(std::string & column, uint64_t value) {
+	while (value >= 0x80) {
+		column.push_back(char(value | 0x80));
+		value >>= 7;
+	}
+	column.push_back(char(value));
+}
+
+static uint64_t get_varint(const char * & p) {
+	uint64_t value = 0;
+	for (int shift = 0;; shift += 7) {
+		unsigned char byte = *p++;
+		value |= uint64_t(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) return value;
+	}
+}
+
+// zigzag encoding keeps small negative deltas small
+static uint64_t zigzag(int64_t value) {
+	return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+	return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
+
+RollupStore::RollupStore() : interval_count(0) {}
+
+RollupStore::program_id RollupStore::intern(const std::string & program) {
+	auto it = program_ids.find(program);
+	if (it != program_ids.end()) return it->second;
+	programs.push_back(program);
+	return program_ids[program] = programs.size() - 1;
+}
+
+RollupStore::program_id RollupStore::find_program(const std::string & program) const {
+	auto it = program_ids.find(program);
+	if (it == program_ids.end()) throw std::out_of_range("unknown program");
+	return it->second;
+}
+
+RollupStore::day_block & RollupStore::block_for(int64_t day) {
+	auto it = days.find(day);
+	if (it == days.end()) it = days.insert({day, day_block(day)}).first;
+	return it->second;
+}
+
+void RollupStore::add_to(std::vector<cell> & cells, program_id program, ProgramRole role, int64_t ms) {
+	for (cell & c : cells)
+		if (c.program == program && c.role == role) {
+			c.total_ms += ms;
+			return;
+		}
+	cells.push_back({program, role, ms});
+}
+
+void RollupStore::add(time_point start, std::chrono::steady_clock::duration dur, const std::string & program, ProgramRole role) {
+	add(start, dur, intern(program), role);
+}
+
+void RollupStore::add(time_point start, std::chrono::steady_clock::duration dur, program_id program, ProgramRole role) {
+	int64_t start_ms = std::chrono::duration_cast<duration>(start.time_since_epoch()).count();
+	int64_t dur_ms = std::chrono::duration_cast<duration>(dur).count();
+
+	// raw columns go to the block of the day the interval started on
+	day_block & block = block_for(local_day_start(start_ms / 1000));
+	put_varint(block.starts, zigzag(start_ms - block.prev_start_ms));
+	put_varint(block.programs, zigzag(int64_t(program) - block.prev_program));
+	block.roles.push_back(char(role));
+	put_varint(block.durations, dur_ms);
+	block.prev_start_ms = start_ms;
+	block.prev_program = program;
+	block.count++;
+	interval_count++;
+
+	// rollups get their share of the interval hour by hour
+	for (int64_t cursor = start_ms, end = start_ms + dur_ms; cursor < end;) {
+		int how;
+		int64_t hour = local_hour_start(cursor / 1000, &how);
+		int64_t part = std::min(end, (hour + 3600) * 1000) - cursor;
+		hour_bucket & bucket = hours[hour];
+		bucket.hour_of_week = how;
+		add_to(bucket.cells, program, role, part);
+		add_to(block_for(local_day_start(hour)).cells, program, role, part);
+		cursor += part;
+	}
+}
+
+void RollupStore::load(const UsageLog & log) {
+	// log string IDs -> our IDs, so that every program is only read once
+	std::unordered_map<uint32_t,program_id> known;
+	for (size_t i = 0; i < log.size(); i++) {
+		UsageLog::entry e = log.at(i);
+		auto it = known.find(e.program);
+		if (it == known.end())
+			it = known.insert({e.program, intern(log.string(e.program))}).first;
+		add(e.start, e.dur, it->second, e.role);
+	}
+}
+
+std::vector<RollupStore::row> RollupStore::totals(Bucket granularity, time_point from, time_point to) const {
+	std::vector<row> ret;
+	auto add_rows = [&ret](int64_t bucket, std::vector<cell> cells) {
+		std::sort(cells.begin(), cells.end(), [](const cell & a, const cell & b) {
+			return a.program < b.program || (a.program == b.program && a.role < b.role);
+		});
+		for (const cell & c : cells)
+			ret.push_back({from_seconds(bucket), c.program, c.role, duration(c.total_ms)});
+	};
+	if (granularity == Bucket::hour) {
+		for (auto it = hours.lower_bound(seconds(from)), end = hours.lower_bound(seconds(to)); it != end; ++it)
+			add_rows(it->first, it->second.cells);
+	} else {
+		for (auto it = days.lower_bound(seconds(from)), end = days.lower_bound(seconds(to)); it != end; ++it)
+			if (!it->second.cells.empty())
+				add_rows(it->first, it->second.cells);
+	}
+	return ret;
+}
+
+std::vector<std::pair<RollupStore::program_id,RollupStore::duration>> RollupStore::program_totals(ProgramRole role, time_point from, time_point to) const {
+	std::vector<int64_t> sums(programs.size(), 0);
+	for (auto it = days.lower_bound(seconds(from)), end = days.lower_bound(seconds(to)); it != end; ++it)
+		for (const cell & c : it->second.cells)
+			if (c.role == role)
+				sums[c.program] += c.total_ms;
+	std::vector<std::pair<program_id,duration>> ret;
+	for (program_id id = 0; id < sums.size(); id++)
+		if (sums[id])
+			ret.push_back({id, duration(sums[id])});
+	// most used first
+	std::sort(ret.begin(), ret.end(), [](const std::pair<program_id,duration> & a, const std::pair<program_id,duration> & b) {
+		return a.second > b.second;
+	});
+	return ret;
+}
+
+std::array<RollupStore::duration,7*24> RollupStore::hour_of_week(ProgramRole role, time_point from, time_point to) const {
+	std::array<duration,7*24> ret;
+	ret.fill(duration::zero());
+	for (auto it = hours.lower_bound(seconds(from)), end = hours.lower_bound(seconds(to)); it != end; ++it)
+		for (const cell & c : it->second.cells)
+			if (c.role == role)
+				ret[it->second.hour_of_week] += duration(c.total_ms);
+	return ret;
+}
+
+std::vector<RollupStore::interval> RollupStore::intervals(time_point from, time_point to) const {
+	std::vector<interval> ret;
+	int64_t from_ms = std::chrono::duration_cast<duration>(from.time_since_epoch()).count();
+	int64_t to_ms = std::chrono::duration_cast<duration>(to.time_since_epoch()).count();
+	for (auto it = days.lower_bound(local_day_start(seconds(from))), end = days.lower_bound(seconds(to) + 1); it != end; ++it) {
+		const day_block & block = it->second;
+		const char * starts = block.starts.data(), * progs = block.programs.data(), * durs = block.durations.data();
+		int64_t start_ms = it->first * 1000, program = 0;
+		for (uint32_t i = 0; i < block.count; i++) {
+			start_ms += unzigzag(get_varint(starts));
+			program += unzigzag(get_varint(progs));
+			int64_t dur_ms = get_varint(durs);
+			if (start_ms >= from_ms && start_ms < to_ms)
+				ret.push_back({
+					time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(duration(start_ms))),
+					duration(dur_ms), (program_id)program, (ProgramRole)block.roles[i]
+				});
+		}
+	}
+	return ret;
+}
+
+size_t RollupStore::column_bytes() const {
+	size_t ret = 0;
+	for (const auto & day : days)
+		ret += day.second.starts.size() + day.second.programs.size() + day.second.roles.size() + day.second.durations.size();
+	return ret;
+}
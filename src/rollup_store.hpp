@@ -0,0 +1,92 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <map>
+#include <array>
+#include <unordered_map>
+#include <chrono>
+#include <cstdint>
+#include "procrastinase.hpp"
+#include "usage_log.hpp"
+
+/*
+Usage history organised for reports rather than for appending.
+
+Raw intervals are kept in one block per local day, column by column (start time,
+program, role, duration), each column delta/varint-encoded. On top of that, totals
+per (program, role) are precomputed for every local hour and every local day, with
+intervals crossing an hour boundary split between the hours. Report queries only
+touch the precomputed totals, so a year of history means a few thousand lookups.
+
+Not synchronized: add intervals and query from the same thread, or lock it yourself.
+*/
+
+class RollupStore {
+public:
+	typedef std::chrono::milliseconds duration;
+	typedef std::chrono::system_clock::time_point time_point;
+	typedef uint32_t program_id;
+
+	enum class Bucket {
+		hour,
+		day
+	};
+	struct row {
+		time_point bucket; // start of the local hour/day
+		program_id program;
+		ProgramRole role;
+		duration total;
+	};
+	struct interval {
+		time_point start;
+		duration dur;
+		program_id program;
+		ProgramRole role;
+	};
+
+	RollupStore();
+	void add(time_point start, std::chrono::steady_clock::duration, const std::string & program, ProgramRole);
+	void load(const UsageLog &); // adds every record of the log
+
+	const std::string & program_name(program_id id) const { return programs[id]; }
+	program_id find_program(const std::string &) const; // throws std::out_of_range if unknown
+
+	// totals for every (bucket, program, role) in [from, to), by bucket then program
+	std::vector<row> totals(Bucket, time_point from, time_point to) const;
+	// totals per program over [from, to), whole days only
+	std::vector<std::pair<program_id,duration>> program_totals(ProgramRole, time_point from, time_point to) const;
+	// index 0 is Sunday 0:00-1:00 local time, like tm_wday
+	std::array<duration,7*24> hour_of_week(ProgramRole, time_point from, time_point to) const;
+	// raw intervals started in [from, to), decoded from the columns
+	std::vector<interval> intervals(time_point from, time_point to) const;
+	size_t size() const { return interval_count; }
+	size_t column_bytes() const;
+private:
+	struct cell {
+		program_id program;
+		ProgramRole role;
+		int64_t total_ms;
+	};
+	struct hour_bucket {
+		int hour_of_week;
+		std::vector<cell> cells;
+	};
+	struct day_block {
+		// deltas start from the day's midnight and program 0
+		day_block(int64_t day) : prev_start_ms(day * 1000), prev_program(0), count(0) {}
+		int64_t prev_start_ms, prev_program;
+		uint32_t count;
+		std::string starts, programs, roles, durations; // varint columns
+		std::vector<cell> cells; // daily rollup
+	};
+	std::vector<std::string> programs;
+	std::unordered_map<std::string,program_id> program_ids;
+	std::map<int64_t,hour_bucket> hours; // by local hour start, seconds since epoch
+	std::map<int64_t,day_block> days; // by local midnight, seconds since epoch
+	size_t interval_count;
+
+	program_id intern(const std::string &);
+	day_block & block_for(int64_t day);
+	void add(time_point, std::chrono::steady_clock::duration, program_id, ProgramRole);
+	static void add_to(std::vector<cell> &, program_id, ProgramRole, int64_t);
+};
@@ -0,0 +1,90 @@
+#include "rule_watcher.hpp"
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <cerrno>
+#include <climits> // NAME_MAX
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+RuleWatcher::RuleWatcher(const std::string & path_, apply_callback apply_, error_callback error_)
+	: path(path_), apply(apply_), error(error_), inotify_fd(-1), stop_fd(-1) {
+	size_t slash = path.rfind('/');
+	std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+	name = slash == std::string::npos ? path : path.substr(slash + 1);
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd < 0) throw std::runtime_error("inotify_init1 returned error");
+	// IN_CLOSE_WRITE: written in place; IN_MOVED_TO: replaced by renaming
+	if (inotify_add_watch(inotify_fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		close(inotify_fd);
+		throw std::runtime_error("can't watch " + dir);
+	}
+	stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (stop_fd < 0) {
+		close(inotify_fd);
+		throw std::runtime_error("eventfd returned error");
+	}
+	// only now: a save between reading and watching would go unnoticed
+	try {
+		load();
+	} catch (...) {
+		close(stop_fd);
+		close(inotify_fd);
+		throw;
+	}
+	thread = std::thread(&RuleWatcher::loop, this);
+}
+
+RuleWatcher::~RuleWatcher() {
+	uint64_t one = 1;
+	if (write(stop_fd, &one, sizeof one)) {}
+	thread.join();
+	close(stop_fd);
+	close(inotify_fd);
+}
+
+void RuleWatcher::print_error(const std::string & message) {
+	std::cerr << message << std::endl;
+}
+
+void RuleWatcher::load() {
+	std::ifstream in(path);
+	if (!in) throw std::runtime_error("can't open " + path);
+	try {
+		apply(read_rules(in));
+	} catch (std::runtime_error & e) {
+		throw std::runtime_error(path + ": " + e.what());
+	}
+}
+
+void RuleWatcher::loop() {
+	alignas(struct inotify_event) char buf[sizeof(struct inotify_event) + NAME_MAX + 1];
+	struct pollfd fds[] = {{stop_fd, POLLIN, 0}, {inotify_fd, POLLIN, 0}};
+	for (;;) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) continue;
+			error("poll returned error, rules won't be reloaded anymore");
+			return;
+		}
+		if (fds[0].revents) return;
+		// a save may come as several events, one reload is enough for all of them
+		bool changed = false;
+		ssize_t len;
+		while ((len = read(inotify_fd, buf, sizeof buf)) > 0) {
+			for (char * p = buf; p < buf + len; ) {
+				struct inotify_event * ev = reinterpret_cast<struct inotify_event*>(p);
+				if (ev->mask & IN_Q_OVERFLOW || (ev->len && name == ev->name))
+					changed = true;
+				p += sizeof(struct inotify_event) + ev->len;
+			}
+		}
+		if (!changed) continue;
+		try {
+			load();
+		} catch (std::runtime_error & e) {
+			error(std::string(e.what()) + ", keeping the old rules");
+		}
+	}
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <string>
+#include <functional>
+#include <thread>
+#include "program_list.hpp"
+
+/*
+Keeps rules in sync with a rule file (see read_rules for the format) without
+restarting anything (Linux-only: inotify, eventfd).
+
+The constructor reads the file once and throws if that fails, so a broken file
+is noticed at startup. After that, a background thread watches the file's
+directory (editors like to save by renaming a new file over the old one), and
+whenever the file is written or replaced, reads and compiles it and passes the
+rules to apply(), e.g. WindowWatcher::set_rules. A file that doesn't read or
+parse is reported to error() and changes nothing: the old rules stay.
+
+Usage:
+	RuleWatcher rules("rules.conf", [&ww](ProgramClassifier::rules && r) { ww.set_rules(std::move(r)); });
+*/
+
+class RuleWatcher {
+public:
+	typedef std::function<void(ProgramClassifier::rules &&)> apply_callback;
+	typedef std::function<void(const std::string &)> error_callback;
+	RuleWatcher(const std::string & path, apply_callback apply, error_callback error = print_error);
+	~RuleWatcher();
+	static void print_error(const std::string &); // to stderr
+
+	RuleWatcher(const RuleWatcher&) = delete;
+	RuleWatcher& operator=(const RuleWatcher&) = delete;
+private:
+	std::string path, name; // name: the last component, which the directory's events report
+	apply_callback apply;
+	error_callback error;
+	int inotify_fd, stop_fd;
+	std::thread thread;
+	void load(); // throws
+	void loop();
+};
@@ -1,12 +1,91 @@
 #include "window_watcher.hpp"
+#include "stats_service.hpp"
+#include "rule_watcher.hpp"
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <csignal>
+#include <pthread.h>
+
+int main(int argc, char ** argv) {
+	std::unique_ptr<TraceWriter> trace;
+	std::string stats_socket, rules;
+	bool single_threaded = false;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		if (i + 1 < argc && arg == "--record") {
+			trace.reset(new TraceWriter(argv[++i]));
+		} else if (i + 1 < argc && arg == "--rules") {
+			rules = argv[++i];
+		} else if (i + 1 < argc && arg == "--stats-socket") {
+			stats_socket = argv[++i];
+		} else if (arg == "--reactor") {
+			single_threaded = true;
+		} else {
+			std::cerr << "Usage: " << argv[0] << " [--rules FILE] [--record TRACE] [--stats-socket PATH] [--reactor]" << std::endl;
+			return 2;
+		}
+	}
+
+	// SIGUSR1 dumps counters and latency histograms to stderr; with the reactor, SIGINT and
+	// SIGTERM stop it cleanly. Block them before any thread is started, so that they all
+	// inherit the mask and only the thread waiting for them gets them
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	if (single_threaded) {
+		sigaddset(&signals, SIGINT);
+		sigaddset(&signals, SIGTERM);
+	}
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
 
-int main() {
 	std::set<std::string> whitelist = {"/usr/bin/stterm"};
+	// a terminal counts as itself only while its shell waits for a command
+	std::set<std::string> terminals = {"/usr/bin/stterm"};
 
 	Statistics stat;
+	UsageLog log("procrastinase.log");
+	stat.persist_to(log);
+	// live totals for dashboards and applets
+	std::unique_ptr<StatsService> service;
+	if (!stats_socket.empty()) service.reset(new StatsService(stat, stats_socket));
 
 	WindowWatcher ww(stat);
-	ww.set_whitelist(whitelist);
+	// the file is reloaded whenever it changes, without losing the intervals so far
+	std::unique_ptr<RuleWatcher> rule_watcher;
+	if (rules.empty())
+		ww.set_whitelist(whitelist);
+	else
+		rule_watcher.reset(new RuleWatcher(rules, [&ww](ProgramClassifier::rules && r) { ww.set_rules(std::move(r)); }));
+	ww.set_terminals(terminals);
+	ww.set_resource_sampling(true);
+	// ten minutes of black-listed apps ring the terminal bell, one more minute gets them killed
+	ww.set_enforcement(std::chrono::minutes(10), std::chrono::minutes(1));
+	ww.on_alarm([](seat_id seat, const ForeignWindow &) {
+		std::cerr << '\a' << "Seat " << seat << ": back to work, or this window gets closed in a minute" << std::endl;
+	});
+	if (trace) ww.record_to(*trace);
+
+	// intervals only say which seat they're from
+	std::vector<std::string> seats = ww.seat_names();
+	if (seats.size() > 1)
+		for (size_t i = 0; i < seats.size(); i++)
+			std::cerr << "Seat " << i << ":\t" << seats[i] << std::endl;
+
+	if (single_threaded) {
+		Reactor reactor;
+		reactor.on_signal(SIGUSR1, [&ww]() { ww.dump_stats(std::cerr); });
+		reactor.on_signal(SIGINT, [&reactor]() { reactor.stop(); });
+		reactor.on_signal(SIGTERM, [&reactor]() { reactor.stop(); });
+		ww.run(reactor);
+		return 0;
+	}
+
+	std::thread([&ww, signals]() {
+		int sig;
+		while (!sigwait(&signals, &sig))
+			ww.dump_stats(std::cerr);
+	}).detach();
 
 	ww.run();
 	return 0;
@@ -1,12 +1,213 @@
 #include "statistics.hpp"
-#include <iostream>
+#include <algorithm> // max
+#include <ctime>
 
-void Statistics::add_program_usage_interval(std::string program, std::string title, std::chrono::steady_clock::duration dur, ProgramRole role) {
-	std::cout \
-		<< "Program:\t" << program << std::endl
-		<< "Title:\t" << title << std::endl
+const size_t batch_capacity = 1024;
+const size_t npos = -1;
+
+size_t Statistics::usage_key_hash::operator()(const usage_key & key) const {
+	std::hash<std::string> h;
+	return h(key.program) * 31 ^ h(key.title) ^ (size_t)key.role ^ (size_t)key.seat << 8;
+}
+
+size_t Statistics::program_key_hash::operator()(const program_key & key) const {
+	return std::hash<std::string>()(key.program) * 3 + (size_t)key.role;
+}
+
+static std::chrono::system_clock::time_point local_midnight(std::chrono::system_clock::time_point t, int days_later = 0) {
+	time_t tt = std::chrono::system_clock::to_time_t(t);
+	struct tm day;
+	localtime_r(&tt, &day);
+	day.tm_hour = day.tm_min = day.tm_sec = 0;
+	day.tm_mday += days_later; // mktime normalizes it
+	day.tm_isdst = -1; // let mktime figure it out
+	return std::chrono::system_clock::from_time_t(mktime(&day));
+}
+
+Statistics::Statistics(std::ostream & out_)
+	: log(nullptr), rollup(nullptr), role_totals(), day_end(local_midnight(std::chrono::system_clock::now(), 1)), generation(0),
+	out(out_), writing(false), finishing(false), inline_printing(false) {
+	// the batch and the writer's copy swap their buffers, so after this adding an interval
+	// doesn't allocate unless the writer falls behind by more than that
+	batch.reserve(batch_capacity);
+	writer = std::thread(&Statistics::write_loop, this);
+}
+
+Statistics::totals_map::iterator Statistics::add_to_totals(const std::string & program, const std::string & title, ProgramRole role, seat_id seat) {
+	lookup.program.assign(program); // reuses the capacity, unlike constructing a key
+	lookup.title.assign(title);
+	lookup.role = role;
+	lookup.seat = seat;
+	auto it = usage.find(lookup);
+	if (it == usage.end())
+		it = usage.insert({lookup, usage_total()}).first;
+	return it;
+}
+
+void Statistics::add_to_aggregates(const usage_key & key, std::chrono::steady_clock::duration dur) {
+	if ((size_t)key.role >= role_totals.size()) return; // a log from the future?
+	role_totals[(size_t)key.role] += dur;
+	auto known = program_of.find(&key);
+	if (known == program_of.end()) {
+		program_lookup.program.assign(key.program);
+		program_lookup.role = key.role;
+		auto it = program_index.find(program_lookup);
+		if (it == program_index.end())
+			it = program_index.insert({program_lookup, npos}).first;
+		if (it->second == npos) {
+			it->second = programs.size();
+			programs.push_back({&it->first.program, key.role, std::chrono::steady_clock::duration::zero()});
+		}
+		known = program_of.insert({&key, it->second}).first;
+	}
+	programs[known->second].total += dur;
+}
+
+/*
+Copies the aggregates into the snapshot buffer the reader doesn't have. The programs
+are a pointer and two numbers each, and only today's are there, so this is a memcpy
+of a few kilobytes at most, and once the buffers have grown to fit every program,
+it doesn't allocate.
+*/
+void Statistics::publish() {
+	snapshot & s = published.back();
+	s.generation = ++generation;
+	s.roles = role_totals;
+	s.programs.assign(programs.begin(), programs.end());
+	published.publish();
+}
+
+/*
+Forgets the day that's over. The writer may still be printing records pointing into
+`usage`, so that has to finish first; the program keys stay, published snapshots point
+to them. The log gets synced once a day too, so opening it never has more to check.
+*/
+void Statistics::roll_over(std::chrono::system_clock::time_point now) {
+	{
+		std::unique_lock<std::mutex> lock(batch_mutex);
+		while (!batch.empty() || writing) batch_written.wait(lock);
+	}
+	usage.clear();
+	program_of.clear();
+	for (const program_total & p : programs) {
+		program_lookup.program.assign(*p.program);
+		program_lookup.role = p.role;
+		program_index[program_lookup] = npos;
+	}
+	programs.clear();
+	role_totals.fill(std::chrono::steady_clock::duration::zero());
+	day_end = local_midnight(now, 1);
+	if (log) log->sync();
+}
+
+void Statistics::persist_to(UsageLog & log_) {
+	log = &log_;
+	log->for_each_since(local_midnight(std::chrono::system_clock::now()), [this](const UsageLog::entry & e) {
+		auto it = add_to_totals(log->string(e.program), log->string(e.title), e.role, e.seat);
+		it->second.time += e.dur;
+		add_to_aggregates(it->first, e.dur);
+	});
+	publish();
+}
+
+void Statistics::rollup_to(RollupStore & rollup_) {
+	rollup = &rollup_;
+}
+
+void Statistics::add_program_usage_interval(const std::string & program, const std::string & title, std::chrono::steady_clock::duration dur, ProgramRole role, seat_id seat, const resource_usage & used, std::chrono::system_clock::time_point start) {
+	if (start == std::chrono::system_clock::time_point())
+		start = std::chrono::system_clock::now() - std::chrono::duration_cast<std::chrono::system_clock::duration>(dur);
+	// an interval belongs to the day it started on, like in persist_to()
+	if (start >= day_end) roll_over(start);
+	if (log) log->append(start, dur, program, title, role, seat);
+	if (rollup) rollup->add(start, dur, program, role); // reports add up all seats
+	auto it = add_to_totals(program, title, role, seat);
+	it->second.time += dur;
+	if (used.sampled) {
+		it->second.cpu += used.cpu;
+		it->second.peak_rss = std::max(it->second.peak_rss, used.rss);
+	}
+	add_to_aggregates(it->first, dur);
+	publish();
+
+	if (inline_printing) {
+		write({&it->first, dur, used});
+		out.flush();
+		return;
+	}
+	bool was_empty;
+	{
+		std::lock_guard<std::mutex> lock(batch_mutex);
+		was_empty = batch.empty();
+		batch.push_back({&it->first, dur, used});
+	}
+	// the writer only sleeps when there's nothing to write, no need to wake it up otherwise
+	if (was_empty) batch_ready.notify_one();
+}
+
+std::chrono::steady_clock::duration Statistics::total(const std::string & program, const std::string & title, ProgramRole role, seat_id seat) const {
+	auto it = usage.find({program, title, role, seat});
+	return it == usage.end() ? std::chrono::steady_clock::duration::zero() : it->second.time;
+}
+
+void Statistics::write_loop() {
+	std::vector<record> taken;
+	taken.reserve(batch_capacity);
+	for (;;) {
+		bool local_finishing;
+		{
+			std::unique_lock<std::mutex> lock(batch_mutex);
+			while (batch.empty() && !finishing) batch_ready.wait(lock);
+			taken.swap(batch); // take everything accumulated so far in one go
+			local_finishing = finishing;
+			writing = true;
+		}
+		for (const record & rec : taken)
+			write(rec);
+		out.flush(); // once per batch instead of std::endl on every line
+		taken.clear();
+		{
+			std::lock_guard<std::mutex> lock(batch_mutex);
+			writing = false;
+		}
+		batch_written.notify_all();
+		if (local_finishing) return;
+	}
+}
+
+void Statistics::write(const record & rec) {
+	out
+		<< "Program:\t" << rec.key->program << '\n'
+		<< "Title:\t" << rec.key->title << '\n'
 		<< "For:\t"
-			<< std::chrono::duration_cast<std::chrono::duration<double>>(dur).count()
-			<< " seconds" << std::endl
-		<< "Role:\t" << (int)role << std::endl;
+			<< std::chrono::duration_cast<std::chrono::duration<double>>(rec.dur).count()
+			<< " seconds" << '\n';
+	if (rec.used.sampled)
+		out
+			<< "CPU:\t"
+				<< std::chrono::duration_cast<std::chrono::duration<double>>(rec.used.cpu).count()
+				<< " seconds" << '\n'
+			<< "RSS:\t" << rec.used.rss / 1024 << " KiB" << '\n';
+	out
+		<< "Role:\t" << (int)rec.key->role << '\n'
+		<< "Seat:\t" << rec.key->seat << '\n';
+}
+
+void Statistics::stop_writer() {
+	if (!writer.joinable()) return;
+	{
+		std::lock_guard<std::mutex> lock(batch_mutex);
+		finishing = true;
+	}
+	batch_ready.notify_one();
+	writer.join(); // writes out whatever is left
+}
+
+void Statistics::print_inline() {
+	stop_writer();
+	inline_printing = true;
+}
+
+Statistics::~Statistics() {
+	stop_writer();
 }
@@ -1,8 +1,138 @@
+#pragma once
 #include <string>
 #include <chrono>
+#include <unordered_map>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+#include <array>
+#include <cstdint>
 #include "procrastinase.hpp"
+#include "triple_buffer.hpp"
+#include "usage_log.hpp"
+#include "rollup_store.hpp"
+
+/*
+Sums up today's usage time per (program, title, role, seat) in memory, together with
+the CPU time and memory of the program if the interval comes with them. The first
+interval starting after local midnight starts a new day with nothing in it: titles
+keep changing, so the sums would grow forever otherwise (the log and the rollups
+keep the history). Every interval is also
+printed, but by a background thread (unless told otherwise, see print_inline()): the
+event loop only updates a hash table and appends to a batch, so a slow terminal or
+pipe can't stall it.
+Intervals can also be persisted to a UsageLog, see persist_to(), and rolled up
+for reports, see rollup_to().
+
+After every interval, totals per role and per (program, role) are published as a
+snapshot that another thread can read without ever holding up this one, see
+latest_snapshot() and StatsService.
+*/
 
 class Statistics {
 public:
-	void add_program_usage_interval(std::string, std::string, std::chrono::steady_clock::duration, ProgramRole);
+	struct usage_key {
+		std::string program, title;
+		ProgramRole role;
+		seat_id seat;
+		bool operator ==(const usage_key & other) const {
+			return role == other.role && seat == other.seat && program == other.program && title == other.title;
+		}
+	};
+	struct usage_key_hash {
+		size_t operator()(const usage_key &) const;
+	};
+	struct usage_total {
+		std::chrono::steady_clock::duration time;
+		std::chrono::steady_clock::duration cpu; // of the intervals that were sampled
+		uint64_t peak_rss; // the largest RSS at the end of an interval
+		usage_total() : time(0), cpu(0), peak_rss(0) {}
+	};
+	typedef std::unordered_map<usage_key,usage_total,usage_key_hash> totals_map;
+	struct program_total {
+		const std::string * program; // never changes or goes away while the Statistics lives
+		ProgramRole role;
+		std::chrono::steady_clock::duration total;
+	};
+	struct snapshot {
+		uint64_t generation; // 0 until the first interval
+		std::array<std::chrono::steady_clock::duration,3> roles; // indexed by ProgramRole
+		std::vector<program_total> programs; // used today, in order of first appearance
+		snapshot() : generation(0), roles() {}
+	};
+
+	Statistics(std::ostream & = std::cout);
+	// start: when the interval began; the default (the epoch) means it has just ended
+	void add_program_usage_interval(const std::string &, const std::string &, std::chrono::steady_clock::duration, ProgramRole, seat_id = 0,
+		const resource_usage & = resource_usage(), std::chrono::system_clock::time_point start = {});
+	// restores today's totals from the log and appends every new interval to it
+	void persist_to(UsageLog &);
+	// adds every new interval to the store too
+	void rollup_to(RollupStore &);
+	// prints every interval right away on the thread adding it, and stops the writer thread;
+	// for a single-threaded Reactor that'd rather block on the output than have threads
+	void print_inline();
+	// only call these from the thread adding the intervals
+	const totals_map & totals() const { return usage; }
+	std::chrono::steady_clock::duration total(const std::string &, const std::string &, ProgramRole, seat_id = 0) const;
+	// the newest published totals; only one thread may call this, and the reference
+	// is only valid until its next call
+	const snapshot & latest_snapshot() {
+		published.update();
+		return published.front();
+	}
+	~Statistics();
+
+	Statistics(const Statistics&) = delete;
+	Statistics& operator=(const Statistics&) = delete;
+private:
+	struct record {
+		const usage_key * key; // points into `usage`, whose nodes never move
+		std::chrono::steady_clock::duration dur;
+		resource_usage used;
+	};
+	totals_map usage;
+	usage_key lookup; // reused for lookups so that known keys cost no allocations
+	UsageLog * log;
+	RollupStore * rollup;
+	totals_map::iterator add_to_totals(const std::string &, const std::string &, ProgramRole, seat_id);
+
+	struct program_key {
+		std::string program;
+		ProgramRole role;
+		bool operator ==(const program_key & other) const {
+			return role == other.role && program == other.program;
+		}
+	};
+	struct program_key_hash {
+		size_t operator()(const program_key &) const;
+	};
+	// into programs, or npos if not used today; never shrinks, snapshots point to the keys
+	std::unordered_map<program_key,size_t,program_key_hash> program_index;
+	program_key program_lookup;
+	// the same, but hashing a pointer instead of the program again; usage keys never move
+	std::unordered_map<const usage_key*,size_t> program_of;
+	std::vector<program_total> programs; // today's
+	std::array<std::chrono::steady_clock::duration,3> role_totals;
+	std::chrono::system_clock::time_point day_end; // the next local midnight
+	void roll_over(std::chrono::system_clock::time_point);
+	uint64_t generation;
+	triple_buffer<snapshot> published;
+	void add_to_aggregates(const usage_key &, std::chrono::steady_clock::duration);
+	void publish();
+
+	std::ostream & out;
+	std::mutex batch_mutex;
+	std::condition_variable batch_ready;
+	std::vector<record> batch; // guarded by batch_mutex
+	bool writing; // guarded by batch_mutex: the writer is busy with what it took from the batch
+	std::condition_variable batch_written; // the batch is empty and the writer idle
+	bool finishing; // guarded by batch_mutex
+	bool inline_printing;
+	std::thread writer;
+	void write_loop();
+	void write(const record &);
+	void stop_writer();
 };
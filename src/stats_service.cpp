@@ -0,0 +1,161 @@
+#include "stats_service.hpp"
+#include <stdexcept>
+#include <cerrno>
+#include <cstdio> // snprintf
+#include <cstring> // strncpy
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// a client not reading its answers (or not sending newlines) gets disconnected past these
+static const size_t max_request = 4096, max_pending_output = 1 << 20;
+
+static const char * role_name(size_t role) {
+	static const char * names[] = {"white", "grey", "black"};
+	return role < 3 ? names[role] : "?";
+}
+
+StatsService::StatsService(Statistics & stat_, const std::string & path_)
+	: stat(stat_), path(path_), listen_fd(-1), stop_fd(-1) {
+	struct sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof addr.sun_path)
+		throw std::runtime_error("socket path is too long: " + path);
+	strncpy(addr.sun_path, path.c_str(), sizeof addr.sun_path - 1);
+	// a socket left behind by a crash would make bind() fail; anything else is not ours to remove
+	struct stat st;
+	if (!lstat(path.c_str(), &st) && S_ISSOCK(st.st_mode))
+		unlink(path.c_str());
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) throw std::runtime_error("socket returned error");
+	// no window between bind() and chmod() in which others could connect
+	mode_t old_mask = umask(0077);
+	int bound = bind(listen_fd, reinterpret_cast<struct sockaddr*>(&addr), sizeof addr);
+	umask(old_mask);
+	if (bound || listen(listen_fd, 16)) {
+		close(listen_fd);
+		throw std::runtime_error("can't listen on " + path);
+	}
+	stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (stop_fd < 0) {
+		close(listen_fd);
+		unlink(path.c_str());
+		throw std::runtime_error("eventfd returned error");
+	}
+	thread = std::thread(&StatsService::loop, this);
+}
+
+StatsService::~StatsService() {
+	uint64_t one = 1;
+	if (write(stop_fd, &one, sizeof one)) {}
+	thread.join();
+	for (client & c : clients)
+		close(c.fd);
+	close(stop_fd);
+	close(listen_fd);
+	unlink(path.c_str());
+}
+
+void StatsService::answer(const std::string & request, std::string & out) {
+	const Statistics::snapshot & s = stat.latest_snapshot();
+	char line[64];
+	if (request == "roles" || request == "programs") {
+		snprintf(line, sizeof line, "generation %llu\n", (unsigned long long)s.generation);
+		out += line;
+	}
+	if (request == "roles") {
+		for (size_t role = 0; role < s.roles.size(); role++) {
+			snprintf(line, sizeof line, "%s %.3f\n", role_name(role), std::chrono::duration<double>(s.roles[role]).count());
+			out += line;
+		}
+	} else if (request == "programs") {
+		for (const Statistics::program_total & p : s.programs) {
+			snprintf(line, sizeof line, "%s %.3f ", role_name((size_t)p.role), std::chrono::duration<double>(p.total).count());
+			out += line;
+			out += *p.program;
+			out += '\n';
+		}
+	} else {
+		out += "error unknown request\n";
+		return;
+	}
+	out += ".\n";
+}
+
+// false if the client should be dropped
+bool StatsService::read_from(client & c) {
+	char buf[4096];
+	for (;;) {
+		ssize_t len = read(c.fd, buf, sizeof buf);
+		if (len == 0) return false;
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+			break;
+		}
+		c.in.append(buf, len);
+	}
+	size_t start = 0, end;
+	while ((end = c.in.find('\n', start)) != std::string::npos) {
+		std::string request = c.in.substr(start, end - start);
+		if (!request.empty() && request.back() == '\r') request.pop_back(); // telnet and friends
+		answer(request, c.out);
+		start = end + 1;
+	}
+	c.in.erase(0, start);
+	return c.in.size() <= max_request && c.out.size() <= max_pending_output;
+}
+
+bool StatsService::write_to(client & c) {
+	while (!c.out.empty()) {
+		ssize_t len = send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+		if (len < 0) {
+			if (errno == EINTR) continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		c.out.erase(0, len);
+	}
+	return true;
+}
+
+void StatsService::loop() {
+	std::vector<struct pollfd> fds;
+	for (;;) {
+		fds.clear();
+		fds.push_back({stop_fd, POLLIN, 0});
+		fds.push_back({listen_fd, POLLIN, 0});
+		for (const client & c : clients)
+			fds.push_back({c.fd, short(POLLIN | (c.out.empty() ? 0 : POLLOUT)), 0});
+		if (poll(fds.data(), fds.size(), -1) < 0) {
+			if (errno == EINTR) continue;
+			return; // nothing sensible to do about it, but the event loop must go on
+		}
+		if (fds[0].revents) return;
+		// clients first: the indices in fds only match until new ones are accepted
+		std::vector<client> kept;
+		kept.reserve(clients.size());
+		for (size_t i = 0; i < clients.size(); i++) {
+			client & c = clients[i];
+			short revents = fds[i + 2].revents;
+			bool ok = true;
+			if (revents & (POLLIN | POLLHUP | POLLERR)) ok = read_from(c);
+			if (ok) ok = write_to(c);
+			if (ok) {
+				kept.push_back(std::move(c));
+			} else {
+				close(c.fd);
+			}
+		}
+		clients.swap(kept);
+		if (fds[1].revents & POLLIN) {
+			int fd;
+			while ((fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+				clients.push_back({fd, std::string(), std::string()});
+		}
+	}
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <thread>
+#include "statistics.hpp"
+
+/*
+Answers queries about the live totals over a Unix-domain socket, for dashboards, tray
+applets and the like (Linux-only: eventfd).
+
+One background thread serves every client from the snapshots Statistics publishes,
+so however many clients poll however often, the thread adding intervals never waits
+for them or for this one.
+
+The protocol is line-based text; requests are answered in order, and a client may
+keep the connection open and send as many as it likes:
+	roles     ->  generation N, then "ROLE SECONDS" for white, grey and black
+	programs  ->  generation N, then "ROLE SECONDS PROGRAM" per program and role
+Every answer ends with a line containing a single dot; unknown requests get
+"error unknown request" instead. The generation grows with every interval added,
+so a poller can tell whether anything has changed.
+*/
+
+class StatsService {
+public:
+	// removes a stale socket at `path` first; the socket is only accessible to the user
+	StatsService(Statistics &, const std::string & path);
+	~StatsService(); // stops serving and removes the socket
+
+	StatsService(const StatsService&) = delete;
+	StatsService& operator=(const StatsService&) = delete;
+private:
+	struct client {
+		int fd;
+		std::string in, out;
+	};
+	Statistics & stat;
+	std::string path;
+	int listen_fd, stop_fd;
+	std::vector<client> clients;
+	std::thread thread;
+	void loop();
+	void answer(const std::string & request, std::string & out);
+	bool read_from(client &);
+	bool write_to(client &);
+};
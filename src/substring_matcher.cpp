@@ -0,0 +1,200 @@
+#include "substring_matcher.hpp"
+#include <map>
+#include <algorithm>
+
+// simple (1:1) case folding, good enough for window titles in Latin, Greek and Cyrillic scripts
+static char32_t fold_code_point(char32_t c) {
+	if (c < 0x80) // ASCII
+		return (c >= 'A' && c <= 'Z') ? c + 0x20 : c;
+	if (c >= 0xC0 && c <= 0xDE && c != 0xD7) // Latin-1 Supplement, except ×
+		return c + 0x20;
+	if (c >= 0x100 && c <= 0x17F) { // Latin Extended-A: mostly even upper, odd lower
+		if (c == 0x130 || c == 0x131 || c == 0x138 || c == 0x149 || c == 0x17F)
+			return c; // dotted/dotless i, kra, 'n and long s don't fold nicely
+		if (c == 0x178) return 0xFF; // Ÿ
+		if ((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E)) // these pairs start at odd code points
+			return (c & 1) ? c + 1 : c;
+		return (c & 1) ? c : c + 1;
+	}
+	if (c >= 0x391 && c <= 0x3AB && c != 0x3A2) // Greek capitals
+		return c + 0x20;
+	if (c == 0x3C2) return 0x3C3; // final sigma
+	if (c >= 0x400 && c <= 0x40F) // Cyrillic capitals with diacritics: Ѐ..Џ
+		return c + 0x50;
+	if (c >= 0x410 && c <= 0x42F) // basic Cyrillic capitals
+		return c + 0x20;
+	if ((c >= 0x460 && c <= 0x481) || (c >= 0x48A && c <= 0x4BF)) // historic and extended Cyrillic pairs
+		return (c & 1) ? c : c + 1;
+	if (c >= 0xFF21 && c <= 0xFF3A) // fullwidth Latin
+		return c + 0x20;
+	return c;
+}
+
+/*
+Feeds the folded bytes of `text` to `out` one by one, without building a new string.
+*/
+template <typename F>
+void SubstringMatcher::fold_each(const std::string & text, F out) const {
+	const unsigned char * p = reinterpret_cast<const unsigned char*>(text.data());
+	const unsigned char * end = p + text.size();
+	switch (match_mode) {
+	case Mode::exact:
+		for (; p != end; p++) out(*p);
+		return;
+	case Mode::ascii_case_insensitive:
+		for (; p != end; p++) out((*p >= 'A' && *p <= 'Z') ? *p + 0x20 : *p);
+		return;
+	case Mode::utf8_case_insensitive:
+		break;
+	}
+	while (p != end) {
+		// decode one code point; anything malformed is passed through as a single byte
+		unsigned len = *p < 0x80 ? 1 : (*p & 0xE0) == 0xC0 ? 2 : (*p & 0xF0) == 0xE0 ? 3 : (*p & 0xF8) == 0xF0 ? 4 : 0;
+		if (len <= 1 || (size_t)(end - p) < len) {
+			out(len == 1 ? fold_code_point(*p) : *p);
+			p++;
+			continue;
+		}
+		char32_t c = *p & (0xFF >> (len + 1));
+		unsigned i;
+		for (i = 1; i < len && (p[i] & 0xC0) == 0x80; i++)
+			c = (c << 6) | (p[i] & 0x3F);
+		if (i < len) { // truncated sequence
+			out(*p);
+			p++;
+			continue;
+		}
+		p += len;
+		c = fold_code_point(c);
+		// encode it back; folding never changes the encoded length in the ranges above
+		if (c < 0x80) {
+			out(c);
+		} else if (c < 0x800) {
+			out(0xC0 | (c >> 6));
+			out(0x80 | (c & 0x3F));
+		} else if (c < 0x10000) {
+			out(0xE0 | (c >> 12));
+			out(0x80 | ((c >> 6) & 0x3F));
+			out(0x80 | (c & 0x3F));
+		} else {
+			out(0xF0 | (c >> 18));
+			out(0x80 | ((c >> 12) & 0x3F));
+			out(0x80 | ((c >> 6) & 0x3F));
+			out(0x80 | (c & 0x3F));
+		}
+	}
+}
+
+std::string SubstringMatcher::fold(const std::string & text) const {
+	std::string ret;
+	ret.reserve(text.size());
+	fold_each(text, [&ret](unsigned char c) { ret.push_back(c); });
+	return ret;
+}
+
+// dense rows are only worth it while they fit in the cache
+const size_t dense_budget = 1 << 20;
+
+SubstringMatcher::SubstringMatcher(const std::list<std::string> & patterns, Mode mode_)
+	: match_mode(mode_) {
+	// 1) build a plain trie; the maps are only needed while building
+	std::vector<std::map<unsigned char,uint32_t>> children(1);
+	std::vector<bool> terminal(1, false);
+	std::fill(byte_class, byte_class + 256, 0);
+	class_count = 1;
+	for (const std::string & pattern : patterns) {
+		uint32_t node = 0;
+		for (unsigned char c : fold(pattern)) {
+			if (!byte_class[c]) byte_class[c] = class_count++;
+			auto it = children[node].find(c);
+			if (it == children[node].end()) {
+				it = children[node].insert({c, (uint32_t)children.size()}).first;
+				children.emplace_back();
+				terminal.push_back(false);
+			}
+			node = it->second;
+		}
+		terminal[node] = true; // an empty pattern marks the root and matches everything
+	}
+
+	// 2) renumber the nodes breadth-first, so parents (and failure targets) come before children
+	std::vector<uint32_t> order, number(children.size());
+	order.reserve(children.size());
+	order.push_back(0);
+	for (size_t i = 0; i < order.size(); i++)
+		for (const auto & child : children[order[i]])
+			order.push_back(child.second);
+	for (uint32_t i = 0; i < order.size(); i++)
+		number[order[i]] = i;
+
+	// 3) flatten the trie and compute failure links in that order
+	states.resize(order.size());
+	for (uint32_t s = 0; s < order.size(); s++) {
+		uint32_t node = order[s];
+		states[s].first_edge = edges.size();
+		states[s].edge_count = children[node].size();
+		if (!s) {
+			states[s].fail = 0;
+			states[s].match = terminal[node];
+		}
+		for (const auto & child : children[node]) { // std::map iterates in byte order
+			uint32_t target = number[child.second];
+			edges.push_back({child.first, target});
+			uint32_t fail = 0;
+			if (s) {
+				// longest proper suffix that's also in the trie
+				for (uint32_t f = order[states[s].fail];; f = order[states[number[f]].fail]) {
+					auto it = children[f].find(child.first);
+					if (it != children[f].end()) {
+						fail = number[it->second];
+						break;
+					}
+					if (!f) break;
+				}
+			}
+			states[target].fail = fail;
+			// failure targets are shallower, so their flag is final already
+			states[target].match = terminal[child.second] || states[fail].match;
+		}
+	}
+
+	// 4) dense rows for as many shallow states as the budget allows
+	dense_states = std::max<size_t>(1, std::min(states.size(), dense_budget / (class_count * sizeof(uint32_t))));
+	dense.assign(dense_states * class_count, 0);
+	for (uint32_t s = 0; s < dense_states; s++) {
+		uint32_t * row = &dense[s * class_count];
+		// start with where the failure state would go; it's shallower, so its row is ready
+		if (s)
+			std::copy(&dense[states[s].fail * class_count], &dense[states[s].fail * class_count] + class_count, row);
+		for (uint32_t e = states[s].first_edge; e < states[s].first_edge + states[s].edge_count; e++)
+			row[byte_class[edges[e].byte]] = edges[e].target;
+	}
+}
+
+uint32_t SubstringMatcher::step(uint32_t s, unsigned char c) const {
+	while (s >= dense_states) {
+		const state & st = states[s];
+		const edge * first = edges.data() + st.first_edge;
+		const edge * last = first + st.edge_count;
+		const edge * it = std::lower_bound(first, last, c,
+			[](const edge & e, unsigned char b) { return e.byte < b; }
+		);
+		if (it != last && it->byte == c)
+			return it->target;
+		s = st.fail; // failure states are shallower, so this ends in a dense one
+	}
+	return dense[s * class_count + byte_class[c]];
+}
+
+bool SubstringMatcher::search(const std::string & text) const {
+	if (states[0].match) return true;
+	uint32_t s = 0;
+	bool found = false;
+	// fold_each can't be interrupted, but once found we just skip the remaining bytes
+	fold_each(text, [this, &s, &found](unsigned char c) {
+		if (found) return;
+		s = step(s, c);
+		found = states[s].match;
+	});
+	return found;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <string>
+#include <list>
+#include <vector>
+#include <cstdint>
+
+/*
+Aho-Corasick automaton answering "does the text contain any of the patterns?"
+in a single pass over the text, no matter how many patterns there are.
+
+Matching is done on UTF-8 bytes. Since UTF-8 is self-synchronizing, a valid
+UTF-8 pattern can only match on character boundaries, so `exact` mode needs
+no decoding at all. The case-insensitive modes fold both the patterns and the
+text before feeding them to the automaton:
+- ascii_case_insensitive only folds A-Z, leaving the other bytes as is;
+- utf8_case_insensitive decodes UTF-8 and applies simple case folding to
+Latin, Greek and Cyrillic letters (invalid sequences are matched byte by byte).
+*/
+
+class SubstringMatcher {
+public:
+	enum class Mode {
+		exact,
+		ascii_case_insensitive,
+		utf8_case_insensitive
+	};
+	SubstringMatcher(const std::list<std::string>&, Mode = Mode::exact);
+	bool search(const std::string&) const;
+	Mode mode() const { return match_mode; }
+private:
+	struct edge {
+		unsigned char byte;
+		uint32_t target;
+	};
+	struct state {
+		uint32_t first_edge, edge_count; // sorted by byte in `edges`
+		uint32_t fail;
+		bool match; // a pattern ends here or on the fail chain
+	};
+	// numbered breadth-first, so states[0] is the root and shallow states come first
+	std::vector<state> states;
+	std::vector<edge> edges;
+	/*
+	Most of the time is spent in shallow states, so the first dense_states of them get
+	full transition rows (with failure links already resolved) indexed by byte class.
+	Bytes that don't occur in any pattern all share class 0.
+	*/
+	uint16_t byte_class[256];
+	uint32_t class_count, dense_states;
+	std::vector<uint32_t> dense;
+	Mode match_mode;
+	uint32_t step(uint32_t, unsigned char) const;
+	std::string fold(const std::string&) const;
+	template <typename F> void fold_each(const std::string&, F) const;
+};
@@ -0,0 +1,111 @@
+#include "trace.hpp"
+#include <stdexcept>
+#include <algorithm>
+
+const char trace_magic[8] = {'P','R','C','T','R','C','E','3'};
+const size_t trace_version_pos = 7;
+
+TraceWriter::TraceWriter(const std::string & path)
+	: out(path, std::ios::binary | std::ios::trunc), started(false), last(0) {
+	if (!out) throw std::runtime_error("can't create " + path);
+	out.write(trace_magic, sizeof trace_magic);
+}
+
+void TraceWriter::put_varint(uint64_t value) {
+	while (value >= 0x80) {
+		out.put(char(value | 0x80));
+		value >>= 7;
+	}
+	out.put(char(value));
+}
+
+void TraceWriter::put_string(const std::string & str) {
+	auto it = strings.find(str);
+	if (it != strings.end()) {
+		put_varint(it->second);
+		return;
+	}
+	uint32_t id = strings.size();
+	strings.insert({str, id});
+	put_varint(id);
+	put_varint(str.size());
+	out.write(str.data(), str.size());
+}
+
+void TraceWriter::write(std::chrono::steady_clock::time_point when, TraceEvent::Type type, seat_id seat, uint32_t pid, const std::string & program, const std::string & title) {
+	if (!started) {
+		start = when;
+		started = true;
+	}
+	TraceEvent ev {type, std::chrono::duration_cast<std::chrono::microseconds>(when - start), pid, program, title, seat};
+	write(ev);
+}
+
+void TraceWriter::write(const TraceEvent & ev) {
+	// events come from one thread in order, but don't let a clock hiccup break the trace
+	std::chrono::microseconds time = std::max(ev.time, last);
+	put_varint((time - last).count());
+	last = time;
+	out.put(char(ev.type));
+	put_varint(ev.seat);
+	if (ev.has_window()) {
+		put_varint(ev.pid);
+		put_string(ev.program);
+		put_string(ev.title);
+	}
+	if (!out) throw std::runtime_error("can't write the trace");
+}
+
+TraceReader::TraceReader(const std::string & path) : in(path, std::ios::binary), last(0) {
+	if (!in) throw std::runtime_error("can't open " + path);
+	char magic[sizeof trace_magic];
+	if (!in.read(magic, sizeof magic) || !std::equal(magic, magic + trace_version_pos, trace_magic))
+		throw std::runtime_error(path + " isn't a trace");
+	if (magic[trace_version_pos] != trace_magic[trace_version_pos])
+		throw std::runtime_error(path + " is a trace of an unknown version");
+}
+
+uint64_t TraceReader::get_varint() {
+	uint64_t value = 0;
+	for (int shift = 0; shift < 64; shift += 7) {
+		int byte = in.get();
+		if (byte == EOF) throw std::runtime_error("truncated trace");
+		value |= uint64_t(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) return value;
+	}
+	throw std::runtime_error("corrupt trace");
+}
+
+void TraceReader::get_string(std::string & str) {
+	uint64_t id = get_varint();
+	if (id < strings.size()) {
+		str = strings[id];
+		return;
+	}
+	if (id != strings.size()) throw std::runtime_error("corrupt trace");
+	str.resize(get_varint());
+	if (!in.read(&str[0], str.size())) throw std::runtime_error("truncated trace");
+	strings.push_back(str);
+}
+
+bool TraceReader::next(TraceEvent & ev) {
+	int first = in.peek();
+	if (first == EOF) return false;
+	last += std::chrono::microseconds(get_varint());
+	ev.time = last;
+	int type = in.get();
+	if (type < 0 || (type > (int)TraceEvent::Type::new_title && type != (int)TraceEvent::Type::user_idle && type != (int)TraceEvent::Type::user_active))
+		throw std::runtime_error("corrupt trace");
+	ev.type = (TraceEvent::Type)type;
+	ev.seat = get_varint();
+	if (ev.has_window()) {
+		ev.pid = get_varint();
+		get_string(ev.program);
+		get_string(ev.title);
+	} else {
+		ev.pid = 0;
+		ev.program.clear();
+		ev.title.clear();
+	}
+	return true;
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <fstream>
+#include <chrono>
+#include <unordered_map>
+#include <cstdint>
+#include "procrastinase.hpp"
+
+/*
+Compact binary trace of window events, for reproducing a day's worth of events
+without a display (see the replay backend).
+
+After an 8-byte magic, every event is:
+	varint microseconds since the previous event, byte event type, varint seat,
+and for window events (new_active, new_title) also:
+	varint PID, string program, string title.
+Events without a window are no_active, user_idle and user_active.
+A string is a varint index into the table of strings seen so far; the next unused
+index is followed by a varint length and the bytes, and adds the string to the table.
+*/
+
+struct TraceEvent {
+	enum class Type : uint8_t { // same values as WindowEvent::Type
+		new_active,
+		no_active,
+		new_title,
+		user_idle = 5,
+		user_active
+	} type;
+	std::chrono::microseconds time; // since the start of the trace
+	uint32_t pid; // 0 if unknown
+	std::string program, title;
+	seat_id seat;
+	bool has_window() const { return type == Type::new_active || type == Type::new_title; }
+};
+
+class TraceWriter {
+public:
+	TraceWriter(const std::string & path);
+	void write(std::chrono::steady_clock::time_point, TraceEvent::Type, seat_id, uint32_t pid = 0, const std::string & program = "", const std::string & title = "");
+	void write(const TraceEvent &); // time is taken as is
+	void flush() { out.flush(); }
+private:
+	std::ofstream out;
+	bool started;
+	std::chrono::steady_clock::time_point start;
+	std::chrono::microseconds last;
+	std::unordered_map<std::string,uint32_t> strings;
+	void put_varint(uint64_t);
+	void put_string(const std::string &);
+};
+
+// what the replay backend plays back, and how fast
+struct ReplaySource {
+	std::string path;
+	enum class Speed {
+		realtime, // every event comes when the trace says it came
+		fast, // as fast as the event loop can go, dated by when it gets there
+		/*
+		As fast as it can go, but the trace's clock is the only one: events are dated
+		by the trace, and deadlines go off between the events they fall between, so
+		whatever the machine is doing meanwhile, every replay comes out the same
+		*/
+		simulated
+	} speed;
+};
+
+class TraceReader {
+public:
+	TraceReader(const std::string & path);
+	bool next(TraceEvent &); // false at the end of the trace
+private:
+	std::ifstream in;
+	std::chrono::microseconds last;
+	std::vector<std::string> strings;
+	uint64_t get_varint();
+	void get_string(std::string &);
+};
@@ -0,0 +1,48 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+/*
+Hands the latest version of a value from one writer thread to one reader thread
+without locks, and without either of them ever waiting for the other.
+
+Usage:
+
+1) The writer fills in back() and calls publish(). back() then refers to another
+buffer, holding some older version: overwrite all of it before publishing again.
+Reusing the buffers means that once they've grown big enough, publishing doesn't allocate.
+2) The reader calls update(), which returns true if something newer was published
+since its last call, and reads front(). front() stays the same until the next update().
+
+Of the three buffers, one is the writer's, one the reader's and one sits in the middle,
+waiting to be taken by whoever comes first. Versions the reader didn't get to are skipped.
+*/
+
+template <typename T>
+class triple_buffer {
+public:
+	triple_buffer() : middle(1), back_index(0), front_index(2) {}
+
+	T & back() { return buffers[back_index]; }
+
+	void publish() {
+		// release: the reader that takes this buffer sees everything written to it
+		back_index = middle.exchange(back_index | fresh, std::memory_order_acq_rel) & index_mask;
+	}
+
+	bool update() {
+		if (!(middle.load(std::memory_order_relaxed) & fresh)) return false;
+		front_index = middle.exchange(front_index, std::memory_order_acq_rel) & index_mask;
+		return true;
+	}
+
+	const T & front() const { return buffers[front_index]; }
+
+	triple_buffer(const triple_buffer&) = delete;
+	triple_buffer& operator=(const triple_buffer&) = delete;
+private:
+	static const uint8_t index_mask = 3, fresh = 4;
+	T buffers[3];
+	std::atomic<uint8_t> middle; // index of the middle buffer, | fresh if the reader hasn't seen it
+	uint8_t back_index, front_index; // only touched by the writer and the reader, respectively
+};
@@ -0,0 +1,321 @@
+#include "usage_log.hpp"
+#include <stdexcept>
+#include <atomic> // atomic_signal_fence
+#include <algorithm>
+#include <cstring>
+#include <climits> // INT64_MIN
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h> // XXX: POSIX-only
+#include <fcntl.h>
+#include <unistd.h>
+
+const char records_magic[] = "procr. usage v2"; // 15 chars + \0
+const char records_magic_v1[] = "procrastinase usage log v1"; // same records, no watermark
+const size_t magic_size = 16; // of the header's magic field; the first 16 bytes tell v1 apart too
+const char strings_magic[] = "procr. strings1"; // 15 chars + \0
+const size_t records_header = 32, strings_header = 16;
+const size_t initial_file_size = 1 << 20; // 32K records; doubles when full
+
+static uint32_t fnv1a(const void * data, size_t len, uint32_t hash = 2166136261u) {
+	const unsigned char * p = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static size_t padded(size_t len) { // keep the string headers aligned
+	return (len + 3) & ~size_t(3);
+}
+
+static bool all_zero(const char * p, size_t len) {
+	return std::all_of(p, p + len, [](char c) { return !c; });
+}
+
+void UsageLog::mapped_file::open(const std::string & path, bool read_only) {
+	fd = ::open(path.c_str(), read_only ? O_RDONLY | O_CLOEXEC : O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) throw std::runtime_error("can't open " + path);
+	struct stat st;
+	if (fstat(fd, &st)) {
+		::close(fd);
+		throw std::runtime_error("can't stat " + path);
+	}
+	size = 0;
+	data = nullptr;
+	if (!read_only) {
+		grow(std::max((size_t)st.st_size, initial_file_size));
+		return;
+	}
+	if (!st.st_size) { // can't map that
+		::close(fd);
+		fd = -1;
+		throw std::runtime_error(path + " isn't a usage log");
+	}
+	void * mapping = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (mapping == MAP_FAILED) {
+		::close(fd);
+		fd = -1;
+		throw std::runtime_error("mmap returned error");
+	}
+	data = static_cast<char*>(mapping);
+	size = st.st_size;
+	madvise(data, size, MADV_SEQUENTIAL); // readers go through it once, front to back
+}
+
+void UsageLog::mapped_file::grow(size_t new_size) {
+	// actually allocate the blocks: running out of disk later would mean SIGBUS, not an error
+	if (posix_fallocate(fd, 0, new_size))
+		throw std::runtime_error("posix_fallocate returned error");
+	if (data) munmap(data, size);
+	void * mapping = mmap(nullptr, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mapping == MAP_FAILED) {
+		data = nullptr;
+		throw std::runtime_error("mmap returned error");
+	}
+	data = static_cast<char*>(mapping);
+	size = new_size;
+}
+
+void UsageLog::mapped_file::close() {
+	if (data) munmap(data, size);
+	if (fd >= 0) ::close(fd);
+	data = nullptr;
+	fd = -1;
+}
+
+UsageLog::UsageLog(const std::string & path, bool read_only_)
+	: record_count(0), strings_end(strings_header), committed_records(0), committed_strings(strings_header),
+	disorder_us(0), latest_start_us(INT64_MIN), read_only(read_only_), strings_indexed(false) {
+	static_assert(sizeof(header) == records_header, "the header doesn't fit");
+	strings.fd = records.fd = -1;
+	strings.data = records.data = nullptr;
+	try {
+		records.open(path, read_only);
+		strings.open(path + ".strings", read_only);
+		if (records.size < records_header || strings.size < strings_header)
+			throw std::runtime_error(path + " isn't a usage log");
+		// new files are all zeros, old ones must be ours
+		bool v1 = false;
+		if (!read_only && all_zero(records.data, records_header) && all_zero(strings.data, strings_header)) {
+			memcpy(records.data, records_magic, sizeof records_magic);
+			memcpy(strings.data, strings_magic, sizeof strings_magic);
+		} else if (memcmp(strings.data, strings_magic, sizeof strings_magic)) {
+			throw std::runtime_error(path + " isn't a usage log");
+		} else if (!memcmp(records.data, records_magic_v1, magic_size)) {
+			upgrade_v1();
+			v1 = true;
+		} else if (memcmp(records.data, records_magic, sizeof records_magic)) {
+			throw std::runtime_error(path + " isn't a usage log");
+		}
+		if (!v1) read_watermark(); // there's none yet, the whole log gets checked like v1 did
+		recover_strings();
+		recover_records();
+		if (!read_only) commit(); // checked now, no need to do it again next time
+	} catch (...) {
+		records.close();
+		strings.close();
+		throw;
+	}
+}
+
+/*
+v1 logs only lack the watermark, so they're upgraded in place: the rest of the header
+is cleared first and the magic goes in last, so that a header torn in between is still
+taken for v1 the next time. Read-only logs are read as they are.
+*/
+void UsageLog::upgrade_v1() {
+	if (read_only) return;
+	memset(records.data + magic_size, 0, records_header - magic_size);
+	std::atomic_signal_fence(std::memory_order_release);
+	memcpy(records.data, records_magic, sizeof records_magic);
+}
+
+// of every field but the magic and itself
+static uint32_t header_checksum(uint32_t committed_records, uint32_t committed_strings, uint32_t disorder_s) {
+	const uint32_t fields[] = {committed_records, committed_strings, disorder_s};
+	return fnv1a(fields, sizeof fields);
+}
+
+// falls back to checking everything if the header doesn't make sense
+void UsageLog::read_watermark() {
+	header h;
+	memcpy(&h, records.data, sizeof h);
+	if (h.checksum != header_checksum(h.committed_records, h.committed_strings, h.disorder_s)
+	|| h.committed_strings < strings_header || h.committed_strings > strings.size
+	|| h.committed_records > (records.size - records_header) / sizeof(record))
+		return;
+	committed_records = h.committed_records;
+	committed_strings = h.committed_strings;
+	disorder_us = h.disorder_s * int64_t(1000000);
+}
+
+/*
+Makes sure that everything appended so far is on disk, and only then says so in the
+header: a watermark reaching past what's really there would let garbage in after a
+power loss. msync() only writes dirty pages, so this costs about as much as what's new.
+*/
+void UsageLog::commit() {
+	if (record_count == committed_records && strings_end == committed_strings) return;
+	if (msync(strings.data, strings.size, MS_SYNC) || msync(records.data, records.size, MS_SYNC))
+		throw std::runtime_error("msync returned error");
+	header h;
+	memcpy(&h, records.data, sizeof h);
+	h.committed_records = record_count;
+	h.committed_strings = strings_end;
+	h.disorder_s = std::min<int64_t>((disorder_us + 999999) / 1000000, UINT32_MAX);
+	h.checksum = header_checksum(h.committed_records, h.committed_strings, h.disorder_s);
+	memcpy(records.data, &h, sizeof h);
+	if (msync(records.data, records_header, MS_SYNC))
+		throw std::runtime_error("msync returned error");
+	committed_records = record_count;
+	committed_strings = strings_end;
+}
+
+/*
+Both recover_* functions walk the file from the watermark until the first entry that's
+all zeros (clean end) or fails its checksum (torn write). In the latter case everything
+after it is wiped, so that the garbage couldn't be mistaken for entries once new ones
+are written over it (unless the log is read-only: nothing will be written then).
+*/
+
+void UsageLog::recover_strings() {
+	size_t pos = committed_strings;
+	while (pos + 2*sizeof(uint32_t) <= strings.size) {
+		uint32_t len, sum;
+		memcpy(&len, strings.data + pos, sizeof len);
+		memcpy(&sum, strings.data + pos + sizeof len, sizeof sum);
+		if (!len && !sum) break; // clean end
+		size_t body = pos + 2*sizeof(uint32_t);
+		if (len > strings.size - body || sum != fnv1a(strings.data + body, len, fnv1a(&len, sizeof len))) {
+			if (!read_only) memset(strings.data + pos, 0, strings.size - pos);
+			break;
+		}
+		pos = body + padded(len);
+	}
+	strings_end = pos;
+}
+
+void UsageLog::recover_records() {
+	// the watermark only keeps the disorder; the latest start is among the last few records
+	for (size_t i = committed_records; i-- && start_us(i) + disorder_us > latest_start_us;)
+		latest_start_us = std::max(latest_start_us, start_us(i));
+	size_t pos = records_header + committed_records * sizeof(record);
+	while (pos + sizeof(record) <= records.size) {
+		record rec;
+		memcpy(&rec, records.data + pos, sizeof rec);
+		if (all_zero(records.data + pos, sizeof rec)) break; // clean end
+		if (rec.checksum != fnv1a(&rec, offsetof(record, checksum))
+		|| rec.program >= strings_end || rec.title >= strings_end) {
+			if (!read_only) memset(records.data + pos, 0, records.size - pos);
+			break;
+		}
+		note_start(rec.start_us);
+		pos += sizeof rec;
+	}
+	record_count = (pos - records_header) / sizeof(record);
+}
+
+// everything up to strings_end has been checked already, only the lengths are needed
+void UsageLog::index_strings() {
+	for (size_t pos = strings_header; pos < strings_end;) {
+		uint32_t len;
+		memcpy(&len, strings.data + pos, sizeof len);
+		size_t body = pos + 2*sizeof(uint32_t);
+		string_ids.insert({std::string(strings.data + body, len), (uint32_t)pos});
+		pos = body + padded(len);
+	}
+	strings_indexed = true;
+}
+
+uint32_t UsageLog::intern(const std::string & str) {
+	if (!strings_indexed) index_strings();
+	auto it = string_ids.find(str);
+	if (it != string_ids.end()) return it->second;
+	size_t need = 2*sizeof(uint32_t) + padded(str.size());
+	if (strings_end + need > UINT32_MAX)
+		throw std::runtime_error("usage log strings are full");
+	if (strings_end + need > strings.size)
+		strings.grow(std::max(strings.size * 2, strings_end + need));
+	char * p = strings.data + strings_end;
+	uint32_t len = str.size();
+	memcpy(p, &len, sizeof len);
+	memcpy(p + 2*sizeof len, str.data(), len);
+	uint32_t sum = fnv1a(str.data(), len, fnv1a(&len, sizeof len));
+	std::atomic_signal_fence(std::memory_order_release); // the checksum goes last, even after compiler optimizations
+	memcpy(p + sizeof len, &sum, sizeof sum);
+	uint32_t id = strings_end;
+	strings_end += need;
+	string_ids.insert({str, id});
+	return id;
+}
+
+void UsageLog::append(std::chrono::system_clock::time_point start, std::chrono::steady_clock::duration dur, const std::string & program, const std::string & title, ProgramRole role, seat_id seat) {
+	using std::chrono::microseconds;
+	using std::chrono::duration_cast;
+	if (read_only) throw std::runtime_error("usage log is read-only");
+	record rec;
+	// strings have to hit the file before the record referring to them
+	rec.program = intern(program);
+	rec.title = intern(title);
+	rec.start_us = duration_cast<microseconds>(start.time_since_epoch()).count();
+	rec.duration_us = duration_cast<microseconds>(dur).count();
+	rec.role = (uint16_t)role;
+	rec.seat = seat;
+	rec.checksum = fnv1a(&rec, offsetof(record, checksum));
+	note_start(rec.start_us);
+
+	size_t pos = records_header + record_count * sizeof(record);
+	if (pos + sizeof rec > records.size)
+		records.grow(records.size * 2);
+	char * p = records.data + pos;
+	memcpy(p, &rec, offsetof(record, checksum));
+	std::atomic_signal_fence(std::memory_order_release);
+	memcpy(p + offsetof(record, checksum), &rec.checksum, sizeof rec.checksum);
+	record_count++;
+}
+
+int64_t UsageLog::start_us(size_t i) const {
+	int64_t ret;
+	memcpy(&ret, records.data + records_header + i * sizeof(record) + offsetof(record, start_us), sizeof ret);
+	return ret;
+}
+
+void UsageLog::note_start(int64_t start) {
+	if (start < latest_start_us) disorder_us = std::max(disorder_us, latest_start_us - start);
+	else latest_start_us = start;
+}
+
+UsageLog::entry UsageLog::at(size_t i) const {
+	using std::chrono::microseconds;
+	record rec;
+	memcpy(&rec, records.data + records_header + i * sizeof(record), sizeof rec);
+	return {
+		std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(microseconds(rec.start_us))),
+		std::chrono::duration_cast<std::chrono::steady_clock::duration>(microseconds(rec.duration_us)),
+		rec.program, rec.title,
+		(ProgramRole)rec.role,
+		rec.seat
+	};
+}
+
+std::string UsageLog::string(uint32_t id) const {
+	if (id < strings_header || id >= strings_end)
+		throw std::out_of_range("unknown usage log string");
+	uint32_t len;
+	memcpy(&len, strings.data + id, sizeof len);
+	return std::string(strings.data + id + 2*sizeof len, len);
+}
+
+void UsageLog::sync() {
+	if (!read_only) commit();
+}
+
+UsageLog::~UsageLog() {
+	if (!read_only && records.data && strings.data) try {
+		commit();
+	} catch (std::runtime_error &) {} // the next open just checks more
+	records.close();
+	strings.close();
+}
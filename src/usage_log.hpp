@@ -0,0 +1,105 @@
+#pragma once
+#include <string>
+#include <chrono>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+#include "procrastinase.hpp"
+
+/*
+Append-only binary log of usage intervals, kept in two preallocated mmap()ed files:
+- <path> holds fixed-size records;
+- <path>.strings holds every distinct program and title once, records refer to them by offset.
+
+Appending is a couple of stores into the mapping, the kernel does the actual writing
+(call sync() if you care about power loss rather than crashes). Every record and
+string carries a checksum written last, so a write torn by a crash is detected and
+cut off the next time the log is opened.
+
+Opening doesn't look at the whole history, though: sync() (and a clean close) also
+records how much of both files is known to be on disk and intact, so only what came
+after that is checked. Likewise, the strings are only indexed for interning on the
+first append. Logs from before the watermark (v1) are upgraded when opened for writing.
+
+Records are appended in the order intervals end, not start: seats are flushed one after
+the other, and idle intervals are dated back by the screen saver timeout. So the log
+also keeps track of disorder(): no record started longer than that before any record
+appended ahead of it. Searches by start time look that much further, then filter.
+
+A log opened read-only (e.g. one exported from another machine) is never modified:
+a torn tail is just ignored, and appending throws.
+*/
+
+class UsageLog {
+public:
+	struct entry {
+		std::chrono::system_clock::time_point start;
+		std::chrono::steady_clock::duration dur;
+		uint32_t program, title; // see string()
+		ProgramRole role;
+		seat_id seat;
+	};
+
+	UsageLog(const std::string & path, bool read_only = false);
+	void append(std::chrono::system_clock::time_point, std::chrono::steady_clock::duration, const std::string &, const std::string &, ProgramRole, seat_id = 0);
+	std::string string(uint32_t) const;
+	size_t size() const { return record_count; }
+	entry at(size_t) const;
+	std::chrono::microseconds disorder() const { return std::chrono::microseconds(disorder_us); }
+	// calls f(entry) for every record started at or after `since`, in the order they were appended
+	template <typename F> void for_each_since(std::chrono::system_clock::time_point since, F f) const {
+		size_t first = record_count;
+		// everything before a record started more than disorder() before `since` started before it, too
+		while (first && at(first-1).start + disorder() >= since) first--;
+		for (size_t i = first; i < record_count; i++) {
+			entry e = at(i);
+			if (e.start >= since) f(e);
+		}
+	}
+	void sync();
+	~UsageLog();
+
+	UsageLog(const UsageLog&) = delete;
+	UsageLog& operator=(const UsageLog&) = delete;
+private:
+	struct record { // 32 bytes, so records never straddle pages
+		int64_t start_us; // since system_clock epoch
+		int64_t duration_us;
+		uint32_t program, title;
+		uint16_t role;
+		uint16_t seat; // was the upper half of a 32-bit role, so old records read as seat 0
+		uint32_t checksum; // must stay the last field
+	};
+	struct mapped_file {
+		int fd;
+		char * data;
+		size_t size;
+		void open(const std::string &, bool read_only);
+		void grow(size_t);
+		void close();
+	};
+	struct header { // at the start of <path>
+		char magic[16];
+		// what's been synced and checked already, see commit()
+		uint32_t committed_records, committed_strings;
+		uint32_t checksum; // of the others, so that a torn header only costs a full check
+		uint32_t disorder_s; // of the committed records, rounded up
+	};
+	mapped_file records, strings;
+	size_t record_count, strings_end;
+	size_t committed_records, committed_strings;
+	int64_t disorder_us; // see disorder()
+	int64_t latest_start_us; // of all records so far, INT64_MIN before the first one
+	bool read_only;
+	bool strings_indexed;
+	std::unordered_map<std::string,uint32_t> string_ids; // empty until strings_indexed
+	uint32_t intern(const std::string &);
+	void index_strings();
+	void upgrade_v1();
+	void read_watermark();
+	void commit();
+	void recover_strings();
+	void recover_records();
+	int64_t start_us(size_t) const;
+	void note_start(int64_t);
+};
@@ -0,0 +1,205 @@
+#include "usage_report.hpp"
+#include "usage_log.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+const size_t default_chunk_records = 1 << 18; // 8 MiB of records
+
+// by (program string offset << 2 | role), in microseconds; only meaningful within one log
+typedef std::unordered_map<uint64_t,int64_t> offset_totals;
+
+struct report_log {
+	std::string path;
+	std::unique_ptr<UsageLog> log; // open while its chunks are being summed
+	std::mutex mutex; // guards the two below
+	offset_totals totals;
+	size_t chunks_left;
+};
+
+struct report_chunk {
+	report_log * log;
+	size_t first, last; // record indices
+};
+
+struct program_role {
+	std::string program;
+	ProgramRole role;
+	bool operator ==(const program_role & other) const {
+		return role == other.role && program == other.program;
+	}
+};
+
+struct program_role_hash {
+	size_t operator()(const program_role & key) const {
+		return std::hash<std::string>()(key.program) * 3 + (size_t)key.role;
+	}
+};
+
+typedef std::unordered_map<program_role,int64_t,program_role_hash> row_totals;
+
+static void sort_rows(std::vector<UsageReport::row> & rows) {
+	std::sort(rows.begin(), rows.end(), [](const UsageReport::row & a, const UsageReport::row & b) {
+		if (a.total != b.total) return a.total > b.total;
+		return a.program != b.program ? a.program < b.program : a.role < b.role;
+	});
+}
+
+/*
+Records aren't quite in start order (see UsageLog), but no record started longer than
+disorder() before one appended ahead of it. So every record before the one returned for
+`when` - disorder() started before `when`, and every record from the one returned for
+`when` + disorder() on started at or after it. Whatever's in between gets filtered.
+*/
+static size_t lower_bound(const UsageLog & log, UsageReport::time_point when) {
+	size_t lo = 0, hi = log.size();
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (log.at(mid).start < when) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+// without overflowing from min() or to max()
+static UsageReport::time_point earlier(UsageReport::time_point t, UsageReport::time_point::duration d) {
+	return t < UsageReport::time_point::min() + d ? UsageReport::time_point::min() : t - d;
+}
+
+static UsageReport::time_point later(UsageReport::time_point t, UsageReport::time_point::duration d) {
+	return t > UsageReport::time_point::max() - d ? UsageReport::time_point::max() : t + d;
+}
+
+UsageReport::UsageReport()
+	: from(time_point::min()), to(time_point::max()),
+	thread_count(std::max(std::thread::hardware_concurrency(), 1u)), chunk(default_chunk_records) {}
+
+std::vector<UsageReport::row> UsageReport::run(const std::vector<std::string> & paths, log_callback per_log) const {
+	std::deque<report_log> logs(paths.size()); // they hold mutexes, so they can't move
+	for (size_t i = 0; i < paths.size(); i++)
+		logs[i].path = paths[i];
+
+	std::mutex mutex; // guards everything up to `error`
+	std::condition_variable changed;
+	std::deque<report_chunk> chunks;
+	size_t next_log = 0;
+	unsigned opening = 0; // workers cutting a log into chunks, which others may want to wait for
+	std::exception_ptr error;
+	std::mutex output_mutex;
+	std::vector<row_totals> totals(thread_count);
+
+	// turns the log's totals into rows; the log isn't needed after that
+	auto finish_log = [&](report_log & rl, row_totals & mine) {
+		std::vector<row> rows;
+		rows.reserve(rl.totals.size());
+		for (const std::pair<const uint64_t,int64_t> & t : rl.totals)
+			rows.push_back({rl.log->string(t.first >> 2), (ProgramRole)(t.first & 3), std::chrono::microseconds(t.second)});
+		rl.totals = offset_totals();
+		rl.log.reset();
+		for (const row & r : rows)
+			mine[{r.program, r.role}] += r.total.count();
+		if (per_log) {
+			sort_rows(rows);
+			std::lock_guard<std::mutex> lock(output_mutex);
+			per_log(rl.path, std::move(rows));
+		}
+	};
+
+	auto open_log = [&](report_log & rl, row_totals & mine) {
+		rl.log.reset(new UsageLog(rl.path, true));
+		time_point::duration disorder = std::chrono::duration_cast<time_point::duration>(rl.log->disorder());
+		size_t first = lower_bound(*rl.log, earlier(from, disorder)), last = lower_bound(*rl.log, later(to, disorder));
+		size_t count = first < last ? (last - first + chunk - 1) / chunk : 0;
+		rl.chunks_left = count;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (size_t i = 0; i < count; i++)
+				chunks.push_back({&rl, first + i * chunk, std::min(first + (i + 1) * chunk, last)});
+			opening--;
+		}
+		changed.notify_all();
+		if (!count) finish_log(rl, mine);
+	};
+
+	auto sum_chunk = [&](const report_chunk & c, offset_totals & local, row_totals & mine) {
+		local.clear(); // keeps the buckets
+		for (size_t i = c.first; i < c.last; i++) {
+			UsageLog::entry e = c.log->log->at(i);
+			if (e.start < from || e.start >= to) continue;
+			local[(uint64_t)e.program << 2 | ((uint64_t)e.role & 3)] += std::chrono::duration_cast<std::chrono::microseconds>(e.dur).count();
+		}
+		bool last;
+		{
+			std::lock_guard<std::mutex> lock(c.log->mutex);
+			for (const std::pair<const uint64_t,int64_t> & t : local)
+				c.log->totals[t.first] += t.second;
+			last = !--c.log->chunks_left;
+		}
+		if (last) finish_log(*c.log, mine);
+	};
+
+	auto worker = [&](unsigned id) {
+		row_totals & mine = totals[id];
+		offset_totals local;
+		try {
+			for (;;) {
+				report_chunk c {nullptr, 0, 0};
+				report_log * to_open = nullptr;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					for (;;) {
+						if (error) return;
+						// finish what's open before opening more
+						if (!chunks.empty()) {
+							c = chunks.front();
+							chunks.pop_front();
+							break;
+						}
+						if (next_log < logs.size()) {
+							to_open = &logs[next_log++];
+							opening++;
+							break;
+						}
+						if (!opening) return;
+						changed.wait(lock);
+					}
+				}
+				if (to_open)
+					open_log(*to_open, mine);
+				else
+					sum_chunk(c, local, mine);
+			}
+		} catch (...) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error) error = std::current_exception();
+			}
+			changed.notify_all();
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for (unsigned i = 1; i < thread_count; i++)
+		threads.emplace_back(worker, i);
+	worker(0);
+	for (std::thread & t : threads)
+		t.join();
+	if (error) std::rethrow_exception(error);
+
+	for (size_t i = 1; i < totals.size(); i++) {
+		for (const std::pair<const program_role,int64_t> & t : totals[i])
+			totals[0][t.first] += t.second;
+		totals[i] = row_totals();
+	}
+	std::vector<row> rows;
+	rows.reserve(totals[0].size());
+	for (const std::pair<const program_role,int64_t> & t : totals[0])
+		rows.push_back({t.first.program, t.first.role, std::chrono::microseconds(t.second)});
+	sort_rows(rows);
+	return rows;
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <cstddef>
+#include "procrastinase.hpp"
+
+/*
+Batch reports over many usage logs at once (say, a team's exported logs for a quarter).
+
+Every log is opened read-only by whichever worker gets to it first, which cuts its records
+started in [from, to) into chunks for all the workers to share. Each chunk is summed
+into a small table of its own, keyed by the log's string offsets, then merged into
+the log's table; the worker finishing the log's last chunk turns it into rows, hands
+them to the per-log callback, adds them to its own totals and closes the log. The
+totals of all the workers are merged at the end.
+
+Workers take chunks of logs already open before opening another one, so only about
+as many logs as there are workers are open at a time, and memory only depends on
+the number of distinct programs, not on the number or size of the logs. Titles are
+left out for the same reason.
+*/
+
+class UsageReport {
+public:
+	typedef std::chrono::system_clock::time_point time_point;
+	struct row {
+		std::string program;
+		ProgramRole role;
+		std::chrono::microseconds total;
+	};
+	// called once per log, in no particular order, never by two workers at a time
+	typedef std::function<void(const std::string & path, std::vector<row> &&)> log_callback;
+
+	UsageReport(); // everything, on every core
+	// only intervals started in [from, to)
+	void set_range(time_point from_, time_point to_) { from = from_; to = to_; }
+	void set_threads(unsigned count) { thread_count = count ? count : 1; }
+	void set_chunk_records(size_t count) { chunk = count ? count : 1; }
+	// totals over all the logs, largest first; throws if a log can't be read
+	std::vector<row> run(const std::vector<std::string> & paths, log_callback per_log = nullptr) const;
+private:
+	time_point from, to;
+	unsigned thread_count;
+	size_t chunk;
+};
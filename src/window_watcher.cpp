@@ -1,41 +1,208 @@
 #include "window_watcher.hpp"
+#include <algorithm> // max
 
 void WindowWatcher::set_whitelist(const std::set<std::string> & wl) {
-	whitelist = wl;
+	ProgramClassifier::rules rules;
+	rules.emplace_back(new ProgramPathSet(ProgramRole::white, wl));
+	classifier.set_rules(std::move(rules));
+}
+
+void WindowWatcher::record(const WindowEvent & ev) {
+	TraceEvent::Type type;
+	switch (ev.type) {
+	case WindowEvent::Type::new_active: type = TraceEvent::Type::new_active; break;
+	case WindowEvent::Type::new_title: type = TraceEvent::Type::new_title; break;
+	case WindowEvent::Type::no_active:
+		recorder->write(ev.captured, TraceEvent::Type::no_active, ev.seat);
+		return;
+	case WindowEvent::Type::user_idle:
+		recorder->write(ev.captured, TraceEvent::Type::user_idle, ev.seat);
+		return;
+	case WindowEvent::Type::user_active:
+		recorder->write(ev.captured, TraceEvent::Type::user_active, ev.seat);
+		return;
+	default: return; // timers are ours, not the window system's
+	}
+	// record what we know, the window may lack some of it
+	std::string title, program;
+	try { title = ev.wnd.get_window_title(); } catch (std::runtime_error &) {}
+	try { program = ev.wnd.get_program_path(); } catch (std::runtime_error &) {}
+	recorder->write(ev.captured, type, ev.seat, ev.wnd.get_process_id(), program, title);
+}
+
+void WindowWatcher::dump_stats(std::ostream & out) const {
+	out << "events: " << event_counters.events
+		<< ", titles dropped: " << event_counters.titles_dropped
+		<< ", titles debounced: " << event_counters.titles_debounced << '\n';
+	out << "classifications cached: " << classifier.hits() << ", evaluated: " << classifier.misses() << '\n';
+	PipelineMetrics::global().dump(out);
+}
+
+void WindowWatcher::handle_queued(const WindowEvent & ev) {
+	PipelineMetrics & metrics = PipelineMetrics::global();
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	metrics.queue_dwell.record(start - ev.queued);
+	handle_event(ev);
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+	metrics.handle_event.record(end - start);
+	metrics.event_lag.record(end - ev.captured);
+}
+
+static const std::string & program_path(path_id program) {
+	static const std::string none;
+	return program == PathTable::no_path ? none : PathTable::global().path(program);
+}
+
+// the log and the rollups want calendar time; the interval may have ended a while ago, so not now() - duration
+static std::chrono::system_clock::time_point wall_clock(std::chrono::steady_clock::time_point t) {
+	return std::chrono::system_clock::now() - std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::steady_clock::now() - t);
 }
 
 // the business logic(TM) method
 void WindowWatcher::handle_event(const WindowEvent & ev) {
+	event_counters.events++;
+	if (recorder) record(ev);
+	if (ev.seat >= seats.size()) seats.resize(ev.seat + 1);
+	seat_state & seat = seats[ev.seat];
+	if ((ev.type == WindowEvent::Type::user_idle || ev.type == WindowEvent::Type::user_active)
+	&& seat.idle == (ev.type == WindowEvent::Type::user_idle))
+		return; // nothing new
+	// not now(): the event may have waited in the queue for a while.
+	// Capture times of one seat only go backwards if the backend's guess was off; don't let that make negative intervals
+	std::chrono::steady_clock::time_point now = std::max(ev.captured, seat.last_event);
 	if (ev.type == WindowEvent::Type::new_active
 	|| ev.type == WindowEvent::Type::new_title
-	|| ev.type == WindowEvent::Type::no_active) { // window activity
-		std::chrono::steady_clock::time_point now {
-			std::chrono::steady_clock::now()
-		};
-		std::chrono::steady_clock::duration dur{now - last_event};
-		last_event = now;
-		stat.add_program_usage_interval(
-			last_program,
-			last_title,
-			dur,
-			last_state
-		);
+	|| ev.type == WindowEvent::Type::no_active
+	|| ev.type == WindowEvent::Type::user_idle
+	|| ev.type == WindowEvent::Type::user_active) { // the end of an interval
+		if (ev.type == WindowEvent::Type::new_title) {
+			// anchored to the start of the burst, not the latest change: otherwise a title
+			// changing faster than the window would keep one interval going forever
+			if (now - seat.burst_start < title_window) {
+				// spinners, progress bars and the like: keep the interval going,
+				// it'll be credited to whatever the title is when it ends
+				seat.last_title = ev.wnd.get_window_title();
+				seat.last_state = classifier.classify(ev.wnd);
+				event_counters.titles_debounced++;
+				enforce(seat, now);
+				return;
+			}
+			seat.burst_start = now;
+		}
+		std::chrono::steady_clock::time_point started = seat.last_event;
+		seat.last_event = now;
+		resource_usage used;
+		if (sample_resources) {
+			// whose next interval starts, if anybody's is going to be counted
+			pid_t next = 0;
+			if (ev.type == WindowEvent::Type::user_active)
+				next = seat.last_pid;
+			else if (!seat.idle && (ev.type == WindowEvent::Type::new_active || ev.type == WindowEvent::Type::new_title))
+				next = ev.wnd.get_process_id();
+			used = sampler.boundary(ev.seat, next);
+		}
+		// while idle, windows still come and go, but the time belongs to nobody
+		if (!seat.idle)
+			stat.add_program_usage_interval(
+				program_path(seat.last_program),
+				seat.last_title,
+				now - started,
+				seat.last_state,
+				ev.seat,
+				used,
+				wall_clock(started)
+			);
 	}
 	switch (ev.type) {
 	case WindowEvent::Type::new_active:
+		watch_window_title(ev.wnd, ev.seat);
+		seat.burst_start = std::chrono::steady_clock::time_point(); // bursts don't carry over to other windows
+		// fall through
 	case WindowEvent::Type::new_title:
-		last_program = ev.wnd.get_program_path();
-		last_title = ev.wnd.get_window_title();
-		last_state = ProgramRole::grey; // TODO *-list logic
+		seat.last_program = ev.wnd.get_program_id();
+		seat.last_title = ev.wnd.get_window_title();
+		seat.last_state = classifier.classify(ev.wnd);
+		seat.last_pid = ev.wnd.get_process_id();
 		break;
 	case WindowEvent::Type::no_active:
-		last_program = last_title = ""; // yay, high-level strings!
-		last_state = ProgramRole::grey; // no active program means timer is inactive too
+		unwatch_window(ev.seat);
+		seat.last_program = PathTable::no_path;
+		seat.last_pid = 0;
+		seat.last_title.clear(); // keeps the capacity
+		seat.last_state = ProgramRole::grey; // no active program means timer is inactive too
 		break;
 	case WindowEvent::Type::alarm_timer:
-		// TODO: sound an alarm, arm the kill timer
+		if (seat.last_state != ProgramRole::black) break; // too late, enforce() takes care of the rest
+		if (sound_alarm) sound_alarm(ev.seat, ev.wnd);
+		if (enforce_kill != std::chrono::steady_clock::duration::zero()) {
+			seat.due = WindowEvent::Type::kill_timer;
+			seat.deadline = now + enforce_kill;
+		}
+		break;
 	case WindowEvent::Type::kill_timer:
-		// TODO: kill the app
-		throw "Unimplemented";
+		if (seat.last_state != ProgramRole::black) break;
+		ev.wnd.kill(killer);
+		break;
+	case WindowEvent::Type::user_idle:
+	case WindowEvent::Type::user_active:
+		seat.idle = ev.type == WindowEvent::Type::user_idle;
+		break;
+	}
+	enforce(seat, now);
+}
+
+// starts, suspends or stops the seat's deadline, see set_enforcement()
+void WindowWatcher::enforce(seat_state & seat, std::chrono::steady_clock::time_point now) {
+	const std::chrono::steady_clock::time_point none;
+	if (enforce_alarm == std::chrono::steady_clock::duration::zero() || seat.last_state != ProgramRole::black) {
+		seat.deadline = none;
+		seat.left = std::chrono::steady_clock::duration::zero();
+		return;
+	}
+	// alarms and kills are about the user, so their deadlines wait for somebody to be back
+	if (seat.idle) {
+		if (seat.deadline != none)
+			seat.left = std::max(seat.deadline - now, std::chrono::steady_clock::duration(1));
+		seat.deadline = none;
+		return;
+	}
+	if (seat.deadline != none) return; // running already
+	if (seat.left == std::chrono::steady_clock::duration::zero()) {
+		seat.due = WindowEvent::Type::alarm_timer;
+		seat.left = enforce_alarm;
+	}
+	seat.deadline = now + seat.left;
+	seat.left = std::chrono::steady_clock::duration::zero();
+}
+
+std::chrono::steady_clock::time_point WindowWatcher::next_deadline() const {
+	std::chrono::steady_clock::time_point ret = std::chrono::steady_clock::time_point::max();
+	for (const seat_state & seat : seats)
+		if (seat.deadline != std::chrono::steady_clock::time_point())
+			ret = std::min(ret, seat.deadline);
+	return ret;
+}
+
+void WindowWatcher::schedule_deadlines(Reactor & reactor) {
+	std::chrono::steady_clock::time_point next = next_deadline();
+	if (deadline_timer && next == deadline_scheduled) return;
+	reactor.cancel(deadline_timer);
+	deadline_timer = Reactor::timer();
+	deadline_scheduled = next;
+	if (next == std::chrono::steady_clock::time_point::max()) return;
+	deadline_timer = reactor.add_abs(next, [this, &reactor]() {
+		deadline_timer = Reactor::timer(); // fired
+		fire_deadlines(Reactor::clock::now());
+		schedule_deadlines(reactor);
+	});
+}
+
+void WindowWatcher::fire_deadlines(std::chrono::steady_clock::time_point now) {
+	for (seat_id i = 0; i < seats.size(); i++) {
+		std::chrono::steady_clock::time_point deadline = seats[i].deadline;
+		if (deadline == std::chrono::steady_clock::time_point() || deadline > now) continue;
+		// handling the event sets the next one; if the backend can't find the window, enforce() will start over
+		seats[i].deadline = std::chrono::steady_clock::time_point();
+		fire(seats[i].due, i, deadline);
 	}
 }
@@ -1,8 +1,19 @@
+#pragma once
 #include "foreign_window.hpp"
+#include "program_list.hpp"
 #include "queue.hpp"
-#include "timer.hpp"
 #include "statistics.hpp"
+#include "trace.hpp"
+#include "metrics.hpp"
+#include "reactor.hpp"
+#include "process_killer.hpp"
+#include "process_table.hpp"
+#include "resource_sampler.hpp"
 #include <set> // FIXME: for now
+#include <atomic>
+#include <functional>
+#include <vector>
+#include <cstdint>
 
 struct WindowWatcherImpl;
 
@@ -11,34 +22,114 @@ struct WindowEvent {
 		new_active,
 		no_active,
 		new_title,
-		alarm_timer,
-		kill_timer
+		alarm_timer, // the seat's black-listed window has been active for too long
+		kill_timer, // and the alarm didn't help
+		user_idle, // nobody's looking at the seat anymore: its time stops counting
+		user_active // somebody's back
 	} type;
-	ForeignWindow wnd;
-	std::string title;
-	WindowEvent(Type t, ForeignWindow && w)
-		: type(t), wnd(std::move(w)) {}
-	WindowEvent(std::string t, ForeignWindow && w)
-		: type(Type::new_title), wnd(std::move(w)), title(t) {}
+	ForeignWindow wnd; // new_title events carry the new title in it; no window at all for no_active and user_*
+	seat_id seat;
+	std::chrono::steady_clock::time_point queued; // for PipelineMetrics::queue_dwell
+	/*
+	When it actually happened, as far as the backend can tell; intervals are measured
+	between these, so however late the event gets handled, the time goes to the right
+	window. Defaults to when the event got created.
+	*/
+	std::chrono::steady_clock::time_point captured;
+	WindowEvent(Type t, ForeignWindow && w, seat_id s = 0, std::chrono::steady_clock::time_point captured_ = {})
+		: type(t), wnd(std::move(w)), seat(s), queued(std::chrono::steady_clock::now()),
+		captured(captured_ == std::chrono::steady_clock::time_point() ? queued : captured_) {}
 };
 
 class WindowWatcher {
 public:
-	WindowWatcher(Statistics &);
+	struct EventCounters {
+		std::atomic<uint64_t> events; // handled by handle_event
+		std::atomic<uint64_t> titles_dropped; // PropertyNotify merged before fetching the title
+		std::atomic<uint64_t> titles_debounced; // title changes merged into the current interval
+		EventCounters() : events(0), titles_dropped(0), titles_debounced(0) {}
+	};
+	WindowWatcher(Statistics &); // not in the replay backend: it has to be told what to replay
+	WindowWatcher(Statistics &, const ReplaySource &); // only in the replay backend
 	void run();
+	// same, but everything happens on the reactor's thread, until the reactor is stopped;
+	// intervals are printed from there too
+	void run(Reactor &);
 	void handle_event(const WindowEvent &);
 	void set_whitelist(const std::set<std::string>&); // FIXME: for now
+	// replaces all the rules deciding the role of a window; safe to call from any thread
+	void set_rules(ProgramClassifier::rules && rules) { classifier.set_rules(std::move(rules)); }
+	// title changes less than this after the one starting the interval don't start a new one,
+	// so a title spinning forever still gets an interval per window (0 disables)
+	void set_title_coalescing(std::chrono::steady_clock::duration window) { title_window = window; }
+	const EventCounters & counters() const { return event_counters; }
+	// counters and PipelineMetrics in human-readable form; safe to call from any thread
+	void dump_stats(std::ostream &) const;
+	// write every window event to the trace, so it could be fed to the replay backend later
+	void record_to(TraceWriter & trace) { recorder = &trace; }
+	// windows of these programs count as whatever runs in their foreground, see ProcessTable
+	void set_terminals(const std::set<std::string> & programs) { ProcessTable::global().set_hosts(programs); }
+	// attach the CPU time and memory of the focused process to every interval; off by
+	// default, since the PIDs of replayed windows aren't those of any process here
+	void set_resource_sampling(bool on) { sample_resources = on; }
+	/*
+	Once black-listed windows have been active on a seat for alarm_after in a row (not
+	counting idle time), the alarm goes off; kill_after later, the active one gets killed,
+	and if it survives, it all starts over. Switching to anything else resets the clock.
+	A zero alarm_after turns it all off (the default), a zero kill_after only alarms.
+	*/
+	void set_enforcement(std::chrono::steady_clock::duration alarm_after, std::chrono::steady_clock::duration kill_after) {
+		enforce_alarm = alarm_after;
+		enforce_kill = kill_after;
+	}
+	// called on the thread running the watcher, with the window that's about to be killed
+	void on_alarm(std::function<void(seat_id, const ForeignWindow &)> alarm) { sound_alarm = std::move(alarm); }
+	// how blocked apps get killed
+	void set_kill_policy(ProcessKiller::Policy policy) { killer.set_policy(policy); }
+	// what the backend calls the seats it watches, e.g. ":1.0" for screen 0 of display :1
+	std::vector<std::string> seat_names() const;
 	~WindowWatcher();
 private:
 	Statistics & stat;
-	std::chrono::steady_clock::time_point last_event;
-	std::string last_program, last_title;
-	ProgramRole last_state;
-	// TODO: alarm sound object
-	std::set<std::string> whitelist; // FIXME: for now
-	thr_queue<WindowEvent> messages;
-	thr_timer tmr;
+	// every seat has its own active window, so its own current interval
+	struct seat_state {
+		std::chrono::steady_clock::time_point last_event;
+		path_id last_program;
+		std::string last_title; // assigned, not constructed, so it only allocates for a title longer than ever before
+		ProgramRole last_state;
+		uint32_t last_pid; // for sampling again when the user comes back
+		std::chrono::steady_clock::time_point burst_start; // the title change starting the current interval
+		bool idle;
+		// see set_enforcement(): what's coming next, and when (the epoch if nothing's running)
+		WindowEvent::Type due;
+		std::chrono::steady_clock::time_point deadline;
+		std::chrono::steady_clock::duration left; // of the deadline, while the seat is idle
+		seat_state()
+			: last_event(std::chrono::steady_clock::now()), last_program(PathTable::no_path),
+			last_state(ProgramRole::grey), last_pid(0), idle(false),
+			due(WindowEvent::Type::alarm_timer), left(0) {}
+	};
+	std::vector<seat_state> seats; // grows on the first event of a seat
+	std::chrono::steady_clock::duration title_window;
+	std::chrono::steady_clock::duration enforce_alarm, enforce_kill;
+	std::function<void(seat_id, const ForeignWindow &)> sound_alarm;
+	EventCounters event_counters;
+	TraceWriter * recorder;
+	bool sample_resources;
+	ResourceSampler sampler;
+	ProgramClassifier classifier;
+	spsc_queue<WindowEvent> messages; // only the backend thread pushes
+	Reactor::timer deadline_timer; // at deadline_scheduled, when running on a Reactor
+	std::chrono::steady_clock::time_point deadline_scheduled;
 	std::unique_ptr<WindowWatcherImpl> impl;
-	void watch_window_title(const ForeignWindow &);
-	void unwatch_window();
+	ProcessKiller killer; // after impl: its callbacks may use the backend's connections, so it has to stop first
+	void watch_window_title(const ForeignWindow &, seat_id);
+	void unwatch_window(seat_id);
+	void record(const WindowEvent &);
+	void handle_queued(const WindowEvent &); // handle_event, measured
+	void enforce(seat_state &, std::chrono::steady_clock::time_point now);
+	std::chrono::steady_clock::time_point next_deadline() const;
+	void fire_deadlines(std::chrono::steady_clock::time_point now); // the ones due by now
+	void schedule_deadlines(Reactor &); // keeps deadline_timer on next_deadline()
+	void fire(WindowEvent::Type, seat_id, std::chrono::steady_clock::time_point); // with the seat's active window
 };
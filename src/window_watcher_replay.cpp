@@ -0,0 +1,161 @@
+#include "window_watcher.hpp"
+#include "private_replay.hpp"
+#include <atomic>
+#include <thread>
+#include <unordered_set>
+#include <algorithm> // max
+
+/*
+Instead of watching a window system, feeds a trace written by WindowWatcher::record_to()
+to the event loop, as the ReplaySource given to the constructor says.
+*/
+
+struct WindowWatcherImpl {
+	std::string path;
+	ReplaySource::Speed speed;
+	std::atomic<bool> done; // the trace has ended, as opposed to breaking
+	// every title seen so far, only touched by whoever reads the trace; never shrinks, windows point here
+	std::unordered_set<std::string> titles;
+	static const std::string no_title;
+
+	ForeignWindowImpl window(const TraceEvent & ev) {
+		auto it = titles.find(ev.title);
+		if (it == titles.end()) it = titles.insert(ev.title).first;
+		return {ev.pid, PathTable::global().intern(ev.program), &*it};
+	}
+
+	// captured: when the trace says it happened; fast replays have to do with "now"
+	WindowEvent event(const TraceEvent & ev, std::chrono::steady_clock::time_point captured = {}) {
+		switch (ev.type) {
+		case TraceEvent::Type::new_active:
+			return {WindowEvent::Type::new_active, window(ev), ev.seat, captured};
+		case TraceEvent::Type::new_title:
+			return {WindowEvent::Type::new_title, window(ev), ev.seat, captured};
+		case TraceEvent::Type::user_idle:
+			return {WindowEvent::Type::user_idle, ForeignWindowImpl{0, PathTable::no_path, &no_title}, ev.seat, captured};
+		case TraceEvent::Type::user_active:
+			return {WindowEvent::Type::user_active, ForeignWindowImpl{0, PathTable::no_path, &no_title}, ev.seat, captured};
+		default:
+			return {WindowEvent::Type::no_active, ForeignWindowImpl{0, PathTable::no_path, &no_title}, ev.seat, captured};
+		}
+	}
+
+	void replay_thread(spsc_queue<WindowEvent> & q) try {
+		TraceReader trace(path);
+		TraceEvent ev;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		while (trace.next(ev)) {
+			if (speed == ReplaySource::Speed::realtime)
+				std::this_thread::sleep_until(start + ev.time);
+			q.push(speed == ReplaySource::Speed::fast ? event(ev) : event(ev, start + ev.time));
+		}
+		// finish() makes pop() throw at once, so let the main thread catch up first
+		q.wait_empty();
+		done = true;
+		q.finish();
+	} catch(...) {
+		// there is noone to catch errors outside this function because it's in a separate thread
+		q.finish(); // main thread will be notified and should investigate
+		return;
+	}
+
+	WindowWatcherImpl(const ReplaySource & source)
+		: path(source.path), speed(source.speed), done(false) {}
+};
+
+const std::string WindowWatcherImpl::no_title;
+
+WindowWatcher::WindowWatcher(Statistics & stat_, const ReplaySource & source)
+	: stat(stat_), seats(1),
+	title_window(std::chrono::seconds(1)), enforce_alarm(0), enforce_kill(0), recorder(nullptr), sample_resources(false),
+	impl(new WindowWatcherImpl(source)) {}
+
+WindowWatcher::~WindowWatcher() = default;
+
+// returns once the whole trace has been handled
+void WindowWatcher::run() {
+	std::thread replay(&WindowWatcherImpl::replay_thread, impl.get(), std::ref(messages));
+	try {
+		if (impl->speed == ReplaySource::Speed::simulated) {
+			// no clock but the trace's: whatever's due by an event goes off right before it
+			for (;;)
+				messages.pop_all([this](WindowEvent && we) {
+					fire_deadlines(we.captured);
+					handle_queued(we);
+				});
+		}
+		for (;;) {
+			// handle a whole burst of events per wakeup, or whatever deadline comes first
+			messages.pop_all_until(next_deadline(), [this](WindowEvent && we) {
+				handle_queued(we);
+			});
+			fire_deadlines(std::chrono::steady_clock::now());
+		}
+	} catch (thr_finished& f) {
+		replay.join();
+		if (!impl->done)
+			throw std::runtime_error("replay thread found error");
+	} catch (...) {
+		messages.finish();
+		replay.join();
+		throw;
+	}
+}
+
+/*
+Every event due is handled from a reactor timer. Going as fast as possible, that means
+batches of events, so that the reactor still gets a chance to look at everything else.
+*/
+void WindowWatcher::run(Reactor & reactor) {
+	stat.print_inline();
+	TraceReader trace(impl->path);
+	TraceEvent ev;
+	bool pending = trace.next(ev);
+	Reactor::clock::time_point start = Reactor::clock::now();
+	std::function<void()> replay_due;
+	Reactor::timer next;
+	bool real_time = impl->speed == ReplaySource::Speed::realtime, simulated = impl->speed == ReplaySource::Speed::simulated;
+	replay_due = [&]() {
+		for (int batch = 0; pending && batch < 256; batch++) {
+			if (real_time && start + ev.time > Reactor::clock::now()) break;
+			if (simulated) fire_deadlines(start + ev.time); // see run()
+			handle_queued(impl->speed == ReplaySource::Speed::fast ? impl->event(ev) : impl->event(ev, start + ev.time));
+			pending = trace.next(ev);
+		}
+		if (!simulated) schedule_deadlines(reactor);
+		if (!pending)
+			reactor.stop(); // that's all, folks
+		else
+			next = reactor.add_abs(real_time ? start + ev.time : Reactor::clock::now(), replay_due);
+	};
+	if (!pending) return;
+	next = reactor.add_abs(start, replay_due);
+	try {
+		reactor.run();
+	} catch (...) {
+		reactor.cancel(next); // it refers to this stack frame
+		reactor.cancel(deadline_timer);
+		throw;
+	}
+	reactor.cancel(next);
+	reactor.cancel(deadline_timer);
+}
+
+// seats are just numbers in a trace; only call this from the thread running the watcher
+std::vector<std::string> WindowWatcher::seat_names() const {
+	std::vector<std::string> ret;
+	for (size_t i = 0; i < std::max<size_t>(seats.size(), 1); i++)
+		ret.push_back("replay:" + std::to_string(i));
+	return ret;
+}
+
+// the window is whatever the trace said last; the event is handled before the title can change
+void WindowWatcher::fire(WindowEvent::Type type, seat_id seat, std::chrono::steady_clock::time_point due) {
+	const seat_state & s = seats[seat];
+	handle_queued(WindowEvent{type, ForeignWindowImpl{s.last_pid, s.last_program, &s.last_title}, seat, due});
+}
+
+// replayed titles come from the trace, there's nothing to watch
+void WindowWatcher::watch_window_title(const ForeignWindow &, seat_id) {}
+
+void WindowWatcher::unwatch_window(seat_id) {}
@@ -1,66 +1,288 @@
 #include "window_watcher.hpp"
 #include "private_xcb.hpp"
+#include <xcb/xcbext.h> // xcb_send_request
+#include <sys/uio.h> // iovec
+#include <atomic>
+#include <deque>
+#include <cerrno>
+#include <cstdlib> // getenv
+#include <cstring> // strchr
+#include <poll.h>
 
-// static member storage
-xcb_atom_t XCB::NET_ACTIVE_WINDOW;
-xcb_atom_t XCB::NET_WM_NAME;
-xcb_atom_t XCB::UTF8_STRING;
-xcb_atom_t XCB::NET_WM_PID;
+/*
+Watches every screen of every display listed in PROCRASTINASE_DISPLAYS (comma-separated,
+e.g. ":0,:1"), or of DISPLAY if that isn't set. Every screen is a seat of its own: it has
+its own root window, so its own active window. One thread (or the reactor) serves all
+the connections, so another seat costs a connection and a few bytes, not a thread.
 
-const size_t title_length = 4096;
+The user counts as idle while the screen saver is on, as told by the MIT-SCREEN-SAVER
+extension, so whatever the user has set up (xset s, a locker) decides what idle is.
+It's all events: nothing polls, so nothing wakes up while nobody's there.
+*/
 
-struct WindowWatcherImpl : public XCB {
-	std::unique_ptr<xcb_connection_t, decltype(&xcb_disconnect)> conn;
+/*
+The few bits of MIT-SCREEN-SAVER that are needed, straight from the protocol, instead of
+depending on libxcb-screensaver for them.
+*/
+namespace screensaver {
+	static xcb_extension_t id = {"MIT-SCREEN-SAVER", 0};
+	const uint8_t select_input_opcode = 2;
+	const uint32_t notify_mask = 1;
+	enum state : uint8_t { off, on, cycle, disabled };
+	struct select_input_request {
+		uint8_t major_opcode, minor_opcode;
+		uint16_t length;
+		xcb_drawable_t drawable;
+		uint32_t event_mask;
+	};
+	struct notify_event { // the extension's first event
+		uint8_t response_type;
+		uint8_t state;
+		uint16_t sequence;
+		xcb_timestamp_t time;
+		xcb_window_t root, window;
+		uint8_t kind, forced; // forced: activated on purpose (locking the screen), not by the timeout
+		uint8_t pad[14];
+	};
+
+	// unchecked, like the other requests nobody waits for
+	static void select_input(xcb_connection_t * conn, xcb_window_t root, uint32_t mask) {
+		static const xcb_protocol_request_t request = {2, &id, select_input_opcode, 1};
+		select_input_request out = {0, 0, 0, root, mask};
+		struct iovec parts[4];
+		parts[2].iov_base = &out;
+		parts[2].iov_len = sizeof out;
+		parts[3].iov_base = nullptr;
+		parts[3].iov_len = -parts[2].iov_len & 3;
+		xcb_send_request(conn, 0, parts + 2, &request);
+	}
+}
 
-	xcb_atom_t get_atom(std::string atom_name) {
-		xcb_intern_atom_cookie_t atom_cookie;
-		std::unique_ptr<xcb_intern_atom_reply_t,decltype(&free)> atom_reply{nullptr,&free};
-		xcb_generic_error_t *err;
+/*
+Maps the timestamps of X events (the server's milliseconds, wrapping around every 49 days,
+on whatever clock the server likes) onto steady_clock, for WindowEvent::captured.
 
-		atom_cookie = xcb_intern_atom(conn.get(), 0, atom_name.length(), atom_name.c_str());
-		atom_reply.reset(xcb_intern_atom_reply(conn.get(), atom_cookie, &err));
-		if (!atom_reply) {
-			free(err);
-			throw std::runtime_error("xcb_intern_atom returned error");
+An event can't have happened after we received it, so the offset between the clocks is
+at most the smallest (received - server time) seen so far; that's the one used, and
+the estimate only gets better with every event that arrives quickly. If the server's
+clock jumps back, events would seem to have waited for ages: past max_skew, start over.
+*/
+class XClock {
+public:
+	typedef std::chrono::steady_clock clock;
+	XClock() : synced(false), last(0), server_ms(0) {}
+	clock::time_point map(xcb_timestamp_t time, clock::time_point received) {
+		if (time == XCB_CURRENT_TIME) return received; // not a real timestamp
+		server_ms = synced ? server_ms + int32_t(time - last) : 0; // unwraps
+		last = time;
+		clock::time_point at = clock::time_point(std::chrono::milliseconds(server_ms)) + offset;
+		if (!synced || received - at > max_skew) {
+			offset = received - clock::time_point(std::chrono::milliseconds(server_ms));
+			synced = true;
+			return received;
 		}
-		return atom_reply->atom;
+		if (at > received) { // faster than ever before
+			offset -= at - received;
+			return received;
+		}
+		return at;
 	}
+private:
+	static constexpr std::chrono::seconds max_skew{5};
+	bool synced;
+	xcb_timestamp_t last;
+	int64_t server_ms; // since the first event, unwrapped
+	clock::duration offset;
+};
+constexpr std::chrono::seconds XClock::max_skew;
+
+// one X server
+struct XDisplay : public XCB {
+	std::unique_ptr<xcb_connection_t, decltype(&xcb_disconnect)> conn;
+	std::string name; // without the screen number
+	size_t first_seat, seat_count; // in WindowWatcherImpl::seats
+	XClock server_clock; // only used by the thread reading events
+	uint8_t screensaver_event; // 0 if the server lacks MIT-SCREEN-SAVER: nobody's ever idle then
+	/*
+	The screen saver timeout, as of the last time we've asked. Asking is unchecked and the
+	reply is only collected at the next idle transition (and the question asked again), so
+	by then it's been waiting in the connection for ages: no round trip on the event thread.
+	*/
+	std::chrono::seconds screensaver_timeout;
+	xcb_get_screen_saver_cookie_t screensaver_asked;
+	bool screensaver_pending;
+
+	XDisplay(const std::string & display)
+		:conn{nullptr,&xcb_disconnect}, first_seat(0), seat_count(0), screensaver_event(0),
+		screensaver_timeout(0), screensaver_pending(false) {
+		conn.reset(xcb_connect(display.empty() ? nullptr : display.c_str(), nullptr));
+		if (xcb_connection_has_error(conn.get())) throw std::runtime_error("xcb_connect returned error");
+		intern_atoms(conn.get());
+		// we watch all the screens anyway, so ":0.1" is the same as ":0"
+		size_t colon = display.rfind(':'), dot = display.rfind('.');
+		name = colon != std::string::npos && dot != std::string::npos && dot > colon ? display.substr(0, dot) : display;
+	}
+};
+
+// one screen of a display
+struct XSeat {
+	XDisplay & display;
+	xcb_window_t root;
+	seat_id id;
+	std::string name;
+	std::atomic<xcb_window_t> currently_watched; // written by main thread, read by XCB thread
+	bool title_changed; // only used by the thread reading events, while it handles a burst
+	std::chrono::steady_clock::time_point title_time; // of the first change in the burst: that's when the old title ended
+	XSeat(XDisplay & display_, xcb_window_t root_, seat_id id_, std::string name_)
+		: display(display_), root(root_), id(id_), name(name_), currently_watched{0} /* 0 seems to be always invalid */, title_changed(false) {}
+};
 
-	xcb_window_t currently_watched;
+struct WindowWatcherImpl {
+	std::deque<XDisplay> displays; // deques don't move their elements, seats point here
+	std::deque<XSeat> seats;
 
-	void set_window_events(xcb_window_t wid, uint32_t value) {
+	// no round trip: if the window is already gone, the error just shows up (and gets ignored) in the event loop
+	static void set_window_events_unchecked(xcb_connection_t * conn, xcb_window_t wid, uint32_t value) {
 		const uint32_t select_input_val[] = { value };
-		xcb_void_cookie_t event_cookie = xcb_change_window_attributes_checked(conn.get(), wid, XCB_CW_EVENT_MASK, select_input_val);
-		std::unique_ptr<xcb_generic_error_t,decltype(&free)> error {xcb_request_check(conn.get(), event_cookie),&free};
-		if (error)
-			throw std::runtime_error("Couldn't change window event mask");
+		xcb_change_window_attributes(conn, wid, XCB_CW_EVENT_MASK, select_input_val);
+		xcb_flush(conn);
 	}
 
-	void active_window_thread(thr_queue<WindowEvent> & q) try {
-		// get the root window
-		xcb_screen_t * screen = xcb_setup_roots_iterator(xcb_get_setup(conn.get())).data;
-		ForeignWindowImpl root{conn.get(), screen->root};
-		// "open" root window and set event mask
-		set_window_events(screen->root, XCB_EVENT_MASK_PROPERTY_CHANGE);
-		// get events corresponding to PropertyNotify event, atom _NET_ACTIVE_WINDOW
-		std::unique_ptr<xcb_generic_event_t,decltype(&free)> event {nullptr,&free};
-		for (event.reset(xcb_wait_for_event(conn.get())); event; event.reset(xcb_wait_for_event(conn.get()))) {
-			if (event->response_type == XCB_PROPERTY_NOTIFY) {
-				xcb_property_notify_event_t * pne = reinterpret_cast<xcb_property_notify_event_t*>(event.get());
-				if (pne->atom == NET_ACTIVE_WINDOW && pne->window == screen->root) {
-					// push them to the queue
-					xcb_window_t new_window = root.get_property<xcb_window_t>(
-						NET_ACTIVE_WINDOW, XCB_ATOM_WINDOW
+	typedef std::unique_ptr<xcb_generic_event_t,decltype(&free)> event_ptr;
+
+	/*
+	Only events about a window fetch its properties, in one round trip; the rest carry
+	XCB_WINDOW_NONE, so that going idle and coming back don't wake up the X server.
+	*/
+	static ForeignWindowImpl fetched(xcb_connection_t * conn, const XCB & atoms, xcb_window_t wid) {
+		ForeignWindowImpl ret(conn, atoms, wid);
+		ret.fetch_properties();
+		return ret;
+	}
+
+	/*
+	Turns `event` and everything after it that's already been read from the display's
+	connection into WindowEvents, passing each to emit(WindowEvent &&). Leaves `event` empty.
+
+	Apps rewriting their titles many times per second flood us with PropertyNotify,
+	so the title is only fetched once for the whole burst.
+	*/
+	template <typename F>
+	void handle_burst(XDisplay & display, event_ptr & event, WindowWatcher::EventCounters & counters, F emit) {
+		latency_histogram::timed timing(PipelineMetrics::global().event_read);
+		xcb_connection_t * conn = display.conn.get();
+		for (size_t i = display.first_seat; i < display.first_seat + display.seat_count; i++)
+			seats[i].title_changed = false;
+		do {
+			if (!event->response_type) { // unchecked requests report their errors here
+				PipelineMetrics::global().errors++;
+				continue;
+			}
+			if (display.screensaver_event && (event->response_type & 0x7f) == display.screensaver_event) {
+				handle_screensaver(display, *reinterpret_cast<screensaver::notify_event*>(event.get()), emit);
+				continue;
+			}
+			if (event->response_type != XCB_PROPERTY_NOTIFY) continue;
+			xcb_property_notify_event_t * pne = reinterpret_cast<xcb_property_notify_event_t*>(event.get());
+			// events read during the round trips below come out of here later than they arrived,
+			// but by then they're already queued with the server's time on them
+			std::chrono::steady_clock::time_point captured = display.server_clock.map(pne->time, std::chrono::steady_clock::now());
+			for (size_t i = display.first_seat; i < display.first_seat + display.seat_count; i++) {
+				XSeat & seat = seats[i];
+				if (pne->atom == display.NET_ACTIVE_WINDOW && pne->window == seat.root) {
+					if (seat.title_changed) counters.titles_dropped++; // belongs to the previous window, not interesting anymore
+					seat.title_changed = false;
+					xcb_window_t new_window = ForeignWindowImpl{conn, display, seat.root}.get_property<xcb_window_t>(
+						display.NET_ACTIVE_WINDOW, XCB_ATOM_WINDOW
 					);
 					if (new_window)
-						q.push({WindowEvent::Type::new_active, ForeignWindowImpl{conn.get(), new_window}});
+						emit(WindowEvent{WindowEvent::Type::new_active, fetched(conn, display, new_window), seat.id, captured});
+					else
+						emit(WindowEvent{WindowEvent::Type::no_active, ForeignWindowImpl{conn, display, XCB_WINDOW_NONE}, seat.id, captured});
+					break;
+				} else if (pne->atom == display.NET_WM_NAME && pne->window == seat.currently_watched) {
+					if (seat.title_changed)
+						counters.titles_dropped++;
 					else
-						q.push({WindowEvent::Type::no_active, ForeignWindowImpl{conn.get(), screen->root/*whatever*/}});
-				} else if (pne->atom == NET_WM_NAME && pne->window == currently_watched) {
-					ForeignWindow w{{conn.get(),pne->window}};
-					q.push({w.impl->get_property(NET_WM_NAME,title_length),std::move(w)});
+						seat.title_time = captured;
+					seat.title_changed = true;
+					break;
 				}
 			}
+		} while (event.reset(xcb_poll_for_queued_event(conn)), event);
+		for (size_t i = display.first_seat; i < display.first_seat + display.seat_count; i++) {
+			xcb_window_t watched = seats[i].currently_watched;
+			if (seats[i].title_changed && watched)
+				emit(WindowEvent{WindowEvent::Type::new_title, fetched(conn, display, watched), seats[i].id, seats[i].title_time});
+		}
+	}
+
+	template <typename F>
+	void handle_screensaver(XDisplay & display, const screensaver::notify_event & sn, F emit) {
+		if (sn.state == screensaver::cycle) return; // still on, just showing something else
+		bool idle = sn.state == screensaver::on;
+		xcb_connection_t * conn = display.conn.get();
+		std::chrono::steady_clock::time_point captured = display.server_clock.map(sn.time, std::chrono::steady_clock::now());
+		if (idle && !sn.forced) {
+			// the timeout has passed since the last input, that's when the user really left
+			update_screensaver_timeout(display);
+			captured -= display.screensaver_timeout;
+		}
+		for (size_t i = display.first_seat; i < display.first_seat + display.seat_count; i++) {
+			XSeat & seat = seats[i];
+			if (sn.root != seat.root) continue;
+			emit(WindowEvent{idle ? WindowEvent::Type::user_idle : WindowEvent::Type::user_active,
+				ForeignWindowImpl{conn, display, XCB_WINDOW_NONE}, seat.id, captured});
+		}
+	}
+
+	// collects the answer asked for last time, if it's there (it's never waited for), and asks again for next time
+	static void update_screensaver_timeout(XDisplay & display) {
+		xcb_connection_t * conn = display.conn.get();
+		if (display.screensaver_pending) {
+			void * reply = nullptr;
+			xcb_generic_error_t * error = nullptr;
+			if (!xcb_poll_for_reply(conn, display.screensaver_asked.sequence, &reply, &error))
+				return; // still on its way (several screens going idle at once), the old value will do
+			std::unique_ptr<xcb_get_screen_saver_reply_t,decltype(&free)> saver {static_cast<xcb_get_screen_saver_reply_t*>(reply), &free};
+			free(error);
+			if (saver) display.screensaver_timeout = std::chrono::seconds(saver->timeout);
+		}
+		display.screensaver_asked = xcb_get_screen_saver(conn);
+		display.screensaver_pending = true;
+		xcb_flush(conn);
+	}
+
+	// handles everything the display has sent so far, without blocking
+	template <typename F>
+	void drain(XDisplay & display, WindowWatcher::EventCounters & counters, F emit) {
+		// the burst loop only looks at what's been read already; this reads more
+		event_ptr event {nullptr,&free};
+		while (event.reset(xcb_poll_for_event(display.conn.get())), event)
+			handle_burst(display, event, counters, emit);
+		if (xcb_connection_has_error(display.conn.get()))
+			throw std::runtime_error("X connection broke");
+	}
+
+	void active_window_thread(spsc_queue<WindowEvent> & q, WindowWatcher::EventCounters & counters) try {
+		auto push = [&q](WindowEvent && we) {
+			q.push(std::move(we));
+		};
+		std::vector<pollfd> fds;
+		for (XDisplay & display : displays) {
+			fds.push_back({xcb_get_file_descriptor(display.conn.get()), POLLIN, 0});
+			drain(display, counters, push); // events read while setting things up won't make the socket readable
+		}
+		for (;;) {
+			if (poll(fds.data(), fds.size(), -1) < 0) {
+				if (errno == EINTR) continue;
+				throw std::runtime_error("poll returned error");
+			}
+			// only this thread waits for replies, and only while handling a display's events,
+			// so there's nothing unread left in the displays whose sockets are quiet
+			for (size_t i = 0; i < fds.size(); i++)
+				if (fds[i].revents)
+					drain(displays[i], counters, push);
 		}
 	} catch(...) {
 		// there is noone to catch errors outside this function because it's in a separate thread
@@ -68,29 +290,72 @@ struct WindowWatcherImpl : public XCB {
 		return;
 	}
 
-	WindowWatcherImpl() :conn{nullptr,&xcb_disconnect}, currently_watched{0} /* 0 seems to be always invalid */ {
-		conn.reset(xcb_connect(nullptr, nullptr));
-		if (!conn) throw std::runtime_error("xcb_connect returned error");
-		NET_WM_NAME = get_atom("_NET_WM_NAME");
-		NET_ACTIVE_WINDOW = get_atom("_NET_ACTIVE_WINDOW");
-		UTF8_STRING = get_atom("UTF8_STRING");
-		NET_WM_PID = get_atom("_NET_WM_PID");
+	WindowWatcherImpl() {
+		std::vector<std::string> names;
+		const char * list = getenv("PROCRASTINASE_DISPLAYS");
+		if (list && *list) {
+			for (const char * p = list;; p++) {
+				const char * end = strchr(p, ',');
+				names.push_back(end ? std::string(p, end) : std::string(p));
+				if (!end) break;
+				p = end;
+			}
+		} else {
+			const char * display = getenv("DISPLAY");
+			names.push_back(display ? display : "");
+		}
+		for (const std::string & name : names) {
+			displays.emplace_back(name);
+			XDisplay & display = displays.back();
+			display.first_seat = seats.size();
+			// "open" root windows and set event mask, checking all of them in one round trip
+			std::vector<xcb_void_cookie_t> cookies;
+			const uint32_t select_input_val[] = { XCB_EVENT_MASK_PROPERTY_CHANGE };
+			int screen = 0;
+			for (xcb_screen_iterator_t it = xcb_setup_roots_iterator(xcb_get_setup(display.conn.get())); it.rem; xcb_screen_next(&it), screen++) {
+				seats.emplace_back(display, it.data->root, seats.size(), display.name + "." + std::to_string(screen));
+				cookies.push_back(xcb_change_window_attributes_checked(display.conn.get(), it.data->root, XCB_CW_EVENT_MASK, select_input_val));
+			}
+			display.seat_count = seats.size() - display.first_seat;
+			const xcb_query_extension_reply_t * saver = xcb_get_extension_data(display.conn.get(), &screensaver::id);
+			if (saver && saver->present) {
+				display.screensaver_event = saver->first_event;
+				for (size_t i = display.first_seat; i < seats.size(); i++)
+					screensaver::select_input(display.conn.get(), seats[i].root, screensaver::notify_mask);
+				// the reply comes with the round trip checking the cookies below
+				display.screensaver_asked = xcb_get_screen_saver(display.conn.get());
+				display.screensaver_pending = true;
+			}
+			bool failed = false;
+			for (xcb_void_cookie_t cookie : cookies) {
+				std::unique_ptr<xcb_generic_error_t,decltype(&free)> error {xcb_request_check(display.conn.get(), cookie),&free};
+				failed = failed || error;
+			}
+			if (failed)
+				throw std::runtime_error("Couldn't change window event mask");
+		}
 	}
 };
 
 WindowWatcher::WindowWatcher(Statistics & stat_)
-	: stat(stat_), last_event(std::chrono::steady_clock::now()),
-	last_state(ProgramRole::grey), impl(new WindowWatcherImpl) {}
+	: stat(stat_),
+	title_window(std::chrono::seconds(1)), enforce_alarm(0), enforce_kill(0), recorder(nullptr), sample_resources(false),
+	impl(new WindowWatcherImpl) {
+	seats.resize(impl->seats.size());
+}
 
 WindowWatcher::~WindowWatcher() = default;
 
 void WindowWatcher::run() {
-	auto window_thread = std::thread(&WindowWatcherImpl::active_window_thread, impl.get(), std::ref(messages));
+	auto window_thread = std::thread(&WindowWatcherImpl::active_window_thread, impl.get(), std::ref(messages), std::ref(event_counters));
 	window_thread.detach();
 	try {
 		for (;;) {
-			WindowEvent we{std::move(messages.pop())};
-			handle_event(we);
+			// handle a whole burst of events per wakeup, or whatever deadline comes first
+			messages.pop_all_until(next_deadline(), [this](WindowEvent && we) {
+				handle_queued(we);
+			});
+			fire_deadlines(std::chrono::steady_clock::now());
 		}
 	} catch (thr_finished& f) {
 		throw std::runtime_error("XCB thread found error");
@@ -99,12 +364,65 @@ void WindowWatcher::run() {
 	}
 }
 
-void WindowWatcher::watch_window_title(const ForeignWindow & wnd) {
-	impl->currently_watched = wnd.impl->wid;
-	impl->set_window_events(wnd.impl->wid, XCB_EVENT_MASK_PROPERTY_CHANGE);
+void WindowWatcher::run(Reactor & reactor) {
+	stat.print_inline();
+	auto handle = [this, &reactor](WindowEvent && we) {
+		handle_queued(we);
+		schedule_deadlines(reactor);
+	};
+	size_t added = 0;
+	try {
+		for (XDisplay & display : impl->displays) {
+			reactor.add_fd(xcb_get_file_descriptor(display.conn.get()), [this, &display, handle]() {
+				impl->drain(display, event_counters, handle);
+			});
+			added++;
+		}
+		// events read while waiting for replies earlier won't make the sockets readable
+		for (XDisplay & display : impl->displays)
+			impl->drain(display, event_counters, handle);
+		reactor.run();
+	} catch (...) {
+		reactor.cancel(deadline_timer);
+		for (size_t i = 0; i < added; i++)
+			reactor.remove_fd(xcb_get_file_descriptor(impl->displays[i].conn.get()));
+		throw;
+	}
+	reactor.cancel(deadline_timer);
+	for (XDisplay & display : impl->displays)
+		reactor.remove_fd(xcb_get_file_descriptor(display.conn.get()));
+}
+
+std::vector<std::string> WindowWatcher::seat_names() const {
+	std::vector<std::string> ret;
+	for (const XSeat & seat : impl->seats)
+		ret.push_back(seat.name);
+	return ret;
+}
+
+void WindowWatcher::fire(WindowEvent::Type type, seat_id seat, std::chrono::steady_clock::time_point due) {
+	XSeat & s = impl->seats[seat];
+	xcb_window_t wid = s.currently_watched;
+	if (!wid) return; // no window, nothing to kill; killing window 0 would be a disaster
+	// handle_event has resolved all of it already, there's no need to ask the X server again
+	const seat_state & state = seats[seat];
+	ForeignWindowImpl wnd(s.display.conn.get(), s.display, wid);
+	wnd.pid = state.last_pid;
+	wnd.program_id = state.last_program;
+	wnd.title = &state.last_title; // the event is handled before the title can change
+	handle_queued(WindowEvent{type, std::move(wnd), seat, due});
+}
+
+void WindowWatcher::watch_window_title(const ForeignWindow & wnd, seat_id seat) {
+	if (impl->seats[seat].currently_watched == wnd.impl->wid) return;
+	unwatch_window(seat);
+	impl->seats[seat].currently_watched = wnd.impl->wid;
+	impl->set_window_events_unchecked(wnd.impl->conn, wnd.impl->wid, XCB_EVENT_MASK_PROPERTY_CHANGE);
 }
 
-void WindowWatcher::unwatch_window() {
-	impl->set_window_events(impl->currently_watched, XCB_EVENT_MASK_NO_EVENT);
-	impl->currently_watched = 0;
+void WindowWatcher::unwatch_window(seat_id seat) {
+	XSeat & s = impl->seats[seat];
+	xcb_window_t watched = s.currently_watched.exchange(0);
+	if (watched)
+		impl->set_window_events_unchecked(s.display.conn.get(), watched, XCB_EVENT_MASK_NO_EVENT);
 }
@@ -0,0 +1,492 @@
+/*
+Behavior checks that need nothing but the replay backend and our own child processes;
+`ctest` runs them.
+
+Usage: checks [SUBSTRING]
+
+Runs every check whose name contains SUBSTRING (all of them by default), prints one
+line per check and exits with 1 if any of them failed.
+*/
+#include "statistics.hpp"
+#include "window_watcher.hpp"
+#include "trace.hpp"
+#include "process_killer.hpp"
+#include "reactor.hpp"
+#include "queue.hpp"
+#include "rollup_store.hpp"
+#include "usage_log.hpp"
+#include "usage_report.hpp"
+#include "fixtures.hpp"
+#include <functional>
+#include <map>
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+/*
+Every operator new in the program goes through here, so that we could check which code
+allocates. While counting is on, every thread's allocations count: the event loop is
+more than the thread running it.
+*/
+static std::atomic<bool> counting_allocations(false);
+static std::atomic<uint64_t> allocations(0);
+
+void * operator new(size_t size) {
+	if (counting_allocations.load(std::memory_order_relaxed)) allocations.fetch_add(1, std::memory_order_relaxed);
+	void * p = malloc(size ? size : 1);
+	if (!p) throw std::bad_alloc();
+	return p;
+}
+
+// not inlined, or GCC sees free() taking what operator new returned and complains
+__attribute__((noinline)) void operator delete(void * p) noexcept {
+	free(p);
+}
+
+struct check_failed : public std::runtime_error {
+	check_failed(const std::string & what) : std::runtime_error(what) {}
+};
+
+static void expect(bool condition, const std::string & what) {
+	if (!condition) throw check_failed(what);
+}
+
+static std::string temp_path(const std::string & name) {
+	return "/tmp/checks-" + std::to_string(getpid()) + "-" + name;
+}
+
+/*
+Kills a bunch of our own children at once, half of them ignoring SIGTERM: those have
+to be escalated to SIGKILL, the rest should go away on their own.
+*/
+static void killer_outcomes() {
+	const unsigned children = 8;
+	std::vector<pid_t> pids;
+	for (unsigned i = 0; i < children; i++) {
+		pid_t pid = fork();
+		if (pid < 0) throw std::runtime_error("fork returned error");
+		if (!pid) {
+			if (i % 2) signal(SIGTERM, SIG_IGN);
+			for (;;) pause();
+		}
+		pids.push_back(pid);
+	}
+	// give the children time to ignore SIGTERM before it comes
+	std::this_thread::sleep_for(std::chrono::milliseconds(50));
+	ProcessKiller killer(ProcessKiller::Policy(std::chrono::milliseconds(20)));
+	std::atomic<unsigned> exited(0), killed(0);
+	for (pid_t pid : pids)
+		killer.kill(pid, process_start_time(pid), [&exited, &killed](pid_t, ProcessKiller::Outcome outcome) {
+			if (outcome == ProcessKiller::Outcome::exited) exited++;
+			if (outcome == ProcessKiller::Outcome::killed) killed++;
+		});
+	while (killer.pending()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	for (pid_t pid : pids) waitpid(pid, nullptr, 0);
+	expect(exited == children / 2, std::to_string(exited) + " of " + std::to_string(children) + " children exited on SIGTERM");
+	expect(killed == children / 2, std::to_string(killed) + " of " + std::to_string(children) + " children needed SIGKILL");
+}
+
+// today's, local time
+static std::chrono::system_clock::time_point local_midnight() {
+	time_t now = time(nullptr);
+	struct tm local;
+	localtime_r(&now, &local);
+	local.tm_hour = local.tm_min = local.tm_sec = 0;
+	local.tm_isdst = -1;
+	return std::chrono::system_clock::from_time_t(mktime(&local));
+}
+
+/*
+An interval running over midnight puts half of itself into the next day's rollup before
+that day has any intervals of its own; the next day's intervals must still read back right.
+*/
+static void rollup_midnight() {
+	RollupStore::time_point midnight = local_midnight();
+	RollupStore rollup;
+	rollup.add(midnight - std::chrono::minutes(30), std::chrono::hours(1), "/usr/bin/late", ProgramRole::black);
+	rollup.add(midnight + std::chrono::hours(2), std::chrono::minutes(10), "/usr/bin/early", ProgramRole::white);
+	std::vector<RollupStore::interval> read = rollup.intervals(midnight - std::chrono::hours(1), midnight + std::chrono::hours(3));
+	expect(read.size() == 2, std::to_string(read.size()) + " intervals read back instead of 2");
+	expect(read[0].start == midnight - std::chrono::minutes(30) && read[0].dur == std::chrono::hours(1)
+		&& rollup.program_name(read[0].program) == "/usr/bin/late", "the interval crossing midnight read back wrong");
+	expect(read[1].start == midnight + std::chrono::hours(2) && read[1].dur == std::chrono::minutes(10)
+		&& rollup.program_name(read[1].program) == "/usr/bin/early", "the interval after midnight read back wrong");
+	std::vector<RollupStore::row> days = rollup.totals(RollupStore::Bucket::day, midnight - std::chrono::hours(48), midnight + std::chrono::hours(3));
+	expect(days.size() == 3 && days[0].total == std::chrono::minutes(30) && days[1].total == std::chrono::minutes(30)
+		&& days[2].total == std::chrono::minutes(10), "the interval crossing midnight wasn't split between the days");
+}
+
+// the first interval of a new day starts the totals over
+static void statistics_midnight() {
+	std::ostringstream out;
+	Statistics stat(out);
+	std::chrono::system_clock::time_point tomorrow = local_midnight() + std::chrono::hours(36); // noon, whatever DST does
+	stat.add_program_usage_interval("/usr/bin/today", "title", std::chrono::minutes(1), ProgramRole::grey, 0,
+		resource_usage(), std::chrono::system_clock::now() - std::chrono::minutes(1));
+	stat.add_program_usage_interval("/usr/bin/tomorrow", "title", std::chrono::minutes(2), ProgramRole::black, 0,
+		resource_usage(), tomorrow);
+	expect(stat.totals().size() == 1 && stat.total("/usr/bin/tomorrow", "title", ProgramRole::black) == std::chrono::minutes(2),
+		"yesterday's totals are still there");
+	stat.add_program_usage_interval("/usr/bin/today", "title", std::chrono::minutes(3), ProgramRole::grey, 0,
+		resource_usage(), tomorrow + std::chrono::minutes(2));
+	const Statistics::snapshot & s = stat.latest_snapshot();
+	expect(s.programs.size() == 2 && *s.programs[0].program == "/usr/bin/tomorrow" && *s.programs[1].program == "/usr/bin/today"
+		&& s.programs[1].total == std::chrono::minutes(3), "the snapshot has more than the new day in it");
+	expect(s.roles[(size_t)ProgramRole::grey] == std::chrono::minutes(3) && s.roles[(size_t)ProgramRole::black] == std::chrono::minutes(2),
+		"the role totals weren't started over");
+}
+
+/*
+A producer waiting in wait_empty() has to wake up when the consumer drains the whole
+queue in one pop_all(), even though thr_waiter only wakes it once per sleep. Every round
+gives it a different amount of time to fall asleep first.
+*/
+static void queue_wait_empty() {
+	for (int round = 0; round < 200; round++) {
+		spsc_queue<int> q(64);
+		std::atomic<bool> pushed(false), woken(false);
+		std::thread producer([&q, &pushed, &woken]() {
+			for (int i = 0; i < 32; i++) q.push(i);
+			pushed = true;
+			q.wait_empty();
+			woken = true;
+		});
+		while (!pushed) std::this_thread::yield();
+		std::this_thread::sleep_for(std::chrono::microseconds(round % 20 * 10));
+		size_t popped = q.pop_all([](int &&) {});
+		std::chrono::steady_clock::time_point give_up = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+		while (!woken && std::chrono::steady_clock::now() < give_up)
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		bool ok = woken;
+		q.finish(); // lets it go if it's stuck
+		producer.join();
+		expect(popped == 32, std::to_string(popped) + " elements in one pop_all() instead of 32");
+		expect(ok, "the producer slept through the queue getting empty in round " + std::to_string(round));
+	}
+}
+
+// a timer cancelling another one due at the same instant: the cancelled one mustn't fire
+static void reactor_cancel_due() {
+	Reactor reactor;
+	Reactor::clock::time_point when = Reactor::clock::now() + std::chrono::milliseconds(1);
+	Reactor::timer second;
+	bool fired = false;
+	reactor.add_abs(when, [&reactor, &second]() { reactor.cancel(second); });
+	second = reactor.add_abs(when, [&fired]() { fired = true; });
+	reactor.add_abs(when + std::chrono::milliseconds(1), [&reactor]() { reactor.stop(); });
+	reactor.run();
+	expect(!fired, "a timer cancelled by one due at the same time fired anyway");
+}
+
+/*
+Opening a log only checks what came after the last sync() or clean close: records
+appended by a process that died without either must still be found (and a torn one
+cut off), and strings written before must still be found when interning.
+*/
+static void usage_log_watermark() {
+	std::string path = temp_path("usage.log");
+	std::chrono::system_clock::time_point t = std::chrono::system_clock::now();
+	{
+		UsageLog log(path);
+		for (int i = 0; i < 100; i++)
+			log.append(t, std::chrono::seconds(1), "/usr/bin/program", "title " + std::to_string(i % 10), ProgramRole::grey);
+	}
+	pid_t child = fork();
+	if (child < 0) throw std::runtime_error("fork returned error");
+	if (!child) {
+		UsageLog * log = new UsageLog(path); // never destroyed, like after a crash
+		for (int i = 0; i < 10; i++)
+			log->append(t, std::chrono::seconds(2), "/usr/bin/crashing", "title", ProgramRole::black);
+		_exit(0);
+	}
+	waitpid(child, nullptr, 0);
+	{
+		UsageLog log(path);
+		expect(log.size() == 110, std::to_string(log.size()) + " records after a crash instead of 110");
+		expect(log.string(log.at(105).program) == "/usr/bin/crashing", "records after a crash read back wrong");
+		log.append(t, std::chrono::seconds(3), "/usr/bin/program", "title 3", ProgramRole::grey);
+		expect(log.at(110).program == log.at(0).program && log.at(110).title == log.at(3).title, "known strings were written again");
+	}
+	{
+		// tear the last record: the watermark covers 111 now, so write one more the crashing way
+		pid_t child = fork();
+		if (child < 0) throw std::runtime_error("fork returned error");
+		if (!child) {
+			UsageLog * log = new UsageLog(path);
+			log->append(t, std::chrono::seconds(4), "/usr/bin/program", "title 4", ProgramRole::grey);
+			_exit(0);
+		}
+		waitpid(child, nullptr, 0);
+		FILE * f = fopen(path.c_str(), "r+b");
+		fseek(f, 32 + 111 * 32 + 8, SEEK_SET);
+		fputc(0x55, f);
+		fclose(f);
+		UsageLog log(path);
+		expect(log.size() == 111, std::to_string(log.size()) + " records after a torn write instead of 111");
+	}
+	remove(path.c_str());
+	remove((path + ".strings").c_str());
+}
+
+static std::string log_magic(const std::string & path) {
+	char magic[32] = {};
+	FILE * f = fopen(path.c_str(), "rb");
+	if (!f) throw std::runtime_error("can't open " + path);
+	size_t read = fread(magic, 1, sizeof magic - 1, f);
+	fclose(f);
+	return std::string(magic, strnlen(magic, read));
+}
+
+// logs from before the watermark have the same records: they open, and get upgraded when written to
+static void usage_log_v1() {
+	std::string path = temp_path("v1.log");
+	std::chrono::system_clock::time_point t = std::chrono::system_clock::now();
+	{
+		UsageLog log(path);
+		for (int i = 0; i < 3; i++)
+			log.append(t, std::chrono::seconds(i), "/usr/bin/program", "title", ProgramRole::grey, i);
+	}
+	{
+		// what v1 wrote there: just the magic
+		char header[32] = "procrastinase usage log v1";
+		FILE * f = fopen(path.c_str(), "r+b");
+		fwrite(header, 1, sizeof header, f);
+		fclose(f);
+	}
+	{
+		UsageLog log(path, true);
+		expect(log.size() == 3 && log.at(2).seat == 2, "a read-only v1 log read back wrong");
+	}
+	expect(log_magic(path) == "procrastinase usage log v1", "a read-only v1 log got modified");
+	{
+		UsageLog log(path);
+		expect(log.size() == 3 && log.string(log.at(2).program) == "/usr/bin/program", "a v1 log read back wrong");
+		log.append(t, std::chrono::seconds(3), "/usr/bin/program", "title", ProgramRole::grey);
+	}
+	expect(log_magic(path) == "procr. usage v2", "a v1 log wasn't upgraded");
+	{
+		UsageLog log(path, true);
+		expect(log.size() == 4, std::to_string(log.size()) + " records after upgrading instead of 4");
+	}
+	remove(path.c_str());
+	remove((path + ".strings").c_str());
+}
+
+/*
+Records go into the log as intervals end, so with two seats, and an idle interval dated
+back by the screen saver timeout, the log isn't in start order around midnight. Today's
+totals picked up again on restart, and reports from or to midnight, must still only
+count what started on the right side of it.
+*/
+static void usage_log_disorder() {
+	std::string path = temp_path("disorder.log");
+	std::chrono::system_clock::time_point midnight = local_midnight();
+	auto minutes = [midnight](int m) { return midnight + std::chrono::minutes(m); };
+	{
+		UsageLog log(path);
+		for (int i = 0; i < 100; i++) // enough of yesterday to search through
+			log.append(minutes(-1000 + i), std::chrono::seconds(30), "/usr/bin/yesterday", "title", ProgramRole::grey);
+		log.append(minutes(10), std::chrono::minutes(5), "/usr/bin/early", "title", ProgramRole::grey, 0);
+		log.append(minutes(-60), std::chrono::hours(2), "/usr/bin/late", "title", ProgramRole::black, 1); // seat 1 switched away at 1:00
+		log.append(minutes(20), std::chrono::minutes(5), "/usr/bin/early", "title", ProgramRole::grey, 0);
+		log.append(minutes(-5), std::chrono::minutes(3), "/usr/bin/editor", "title", ProgramRole::white, 2); // idle since 23:58, noticed at 0:03
+		log.append(minutes(70), std::chrono::minutes(10), "/usr/bin/late", "title", ProgramRole::black, 1);
+	}
+	{
+		UsageLog log(path, true);
+		expect(log.disorder() >= std::chrono::minutes(70), "the log's disorder wasn't kept across opening it again");
+	}
+	{
+		std::ostringstream out;
+		Statistics stat(out);
+		UsageLog log(path);
+		stat.persist_to(log);
+		expect(stat.total("/usr/bin/early", "title", ProgramRole::grey, 0) == std::chrono::minutes(10)
+			&& stat.total("/usr/bin/late", "title", ProgramRole::black, 1) == std::chrono::minutes(10)
+			&& stat.total("/usr/bin/editor", "title", ProgramRole::white, 2) == std::chrono::seconds(0),
+			"today's totals read back wrong from a log out of start order");
+	}
+	auto report = [&path](std::chrono::system_clock::time_point from, std::chrono::system_clock::time_point to) {
+		UsageReport r;
+		r.set_range(from, to);
+		r.set_chunk_records(7);
+		std::map<std::string,std::chrono::microseconds> ret;
+		for (const UsageReport::row & row : r.run({path}))
+			ret[row.program] = row.total;
+		return ret;
+	};
+	std::map<std::string,std::chrono::microseconds> today = report(midnight, minutes(60));
+	expect(today.size() == 1 && today["/usr/bin/early"] == std::chrono::minutes(10), "a report from midnight counted the wrong intervals");
+	std::map<std::string,std::chrono::microseconds> yesterday = report(minutes(-1000), midnight);
+	expect(yesterday.size() == 3 && yesterday["/usr/bin/yesterday"] == std::chrono::minutes(50)
+		&& yesterday["/usr/bin/late"] == std::chrono::hours(2) && yesterday["/usr/bin/editor"] == std::chrono::minutes(3),
+		"a report up to midnight counted the wrong intervals");
+	remove(path.c_str());
+	remove((path + ".strings").c_str());
+}
+
+/*
+Once every program and title has been seen, handling an event shouldn't allocate: after
+warming up on two cycles of the trace, the rest of the run must not allocate at all.
+Alarms (program3 is black-listed, and stays active long enough every cycle) mark where
+counting starts and ends, so that's the same events every time, and the end of the
+replay isn't counted.
+*/
+static void steady_state_allocations() {
+	std::string path = temp_path("allocations.trace");
+	write_cycling_trace(path, cycling_trace_period * 4);
+	null_buf nb;
+	std::ostream out(&nb);
+	Statistics stat(out);
+	WindowWatcher ww(stat, {path, ReplaySource::Speed::simulated});
+	ProgramClassifier::rules rules;
+	rules.emplace_back(new ProgramPathSet(ProgramRole::black, {"/usr/bin/program3"}));
+	rules.emplace_back(new WindowTitleSubstringList(ProgramRole::black, {"13", "57"}));
+	ww.set_rules(std::move(rules));
+	ww.set_enforcement(std::chrono::milliseconds(5), std::chrono::steady_clock::duration::zero());
+	uint64_t counted_from = 0, counted_to = 0, allocated = 0;
+	ww.on_alarm([&](seat_id, const ForeignWindow &) {
+		if (counted_from) {
+			counted_to = ww.counters().events;
+			allocated = allocations;
+		} else if (ww.counters().events >= cycling_trace_period * 2) {
+			counted_from = ww.counters().events;
+			allocations = 0;
+			counting_allocations = true;
+		}
+	});
+	ww.run();
+	counting_allocations = false;
+	remove(path.c_str());
+	expect(counted_to > counted_from + cycling_trace_period, "the alarms didn't go off");
+	expect(allocated == 0, std::to_string(allocated) + " allocations in " + std::to_string(counted_to - counted_from) + " steady-state events");
+}
+
+/*
+A title changing every 500 ms for 10 s: coalescing must still close an interval every
+second instead of merging all of it into one. The intervals must also be dated by when
+they happened, back to back. Replayed on the trace's clock, so the numbers are exact.
+*/
+static void title_debounce_cap() {
+	std::string path = temp_path("titles.trace");
+	{
+		TraceWriter trace(path);
+		trace.write({TraceEvent::Type::new_active, std::chrono::microseconds(0), 1000, "/usr/bin/spinner", "0%", 0});
+		for (int i = 1; i < 20; i++)
+			trace.write({TraceEvent::Type::new_title, std::chrono::milliseconds(500 * i), 1000, "/usr/bin/spinner", std::to_string(i * 5) + "%", 0});
+		trace.write({TraceEvent::Type::no_active, std::chrono::seconds(10), 0, "", "", 0});
+	}
+	std::ostringstream out;
+	RollupStore rollup;
+	{
+		Statistics stat(out);
+		stat.rollup_to(rollup);
+		WindowWatcher ww(stat, {path, ReplaySource::Speed::simulated});
+		ww.run();
+	}
+	remove(path.c_str());
+	std::chrono::milliseconds total(0), longest(0);
+	size_t count = 0;
+	RollupStore::time_point end;
+	for (const RollupStore::interval & i : rollup.intervals(RollupStore::time_point(), RollupStore::time_point::max())) {
+		if (rollup.program_name(i.program) != "/usr/bin/spinner") continue;
+		// dated by when they started, not by when they got handled, so they follow each other
+		// (up to the rounding to milliseconds of calendar time)
+		expect(!count || (i.start - end < std::chrono::milliseconds(2) && end - i.start < std::chrono::milliseconds(2)),
+			"an interval started " + std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(i.start - end).count()) + " ms after the previous one ended");
+		end = i.start + i.dur;
+		total += i.dur;
+		longest = std::max(longest, i.dur);
+		count++;
+	}
+	// 0-500 ms, then a second per interval, and the last half second
+	expect(longest == std::chrono::milliseconds(1000), "the longest interval lasted " + std::to_string(longest.count()) + " ms");
+	expect(count == 11, std::to_string(count) + " intervals in 10 s instead of 11");
+	expect(total == std::chrono::seconds(10), std::to_string(total.count()) + " ms counted out of 10 s");
+}
+
+/*
+A black-listed window active for a second, with the user away for half a second in
+the middle: the alarm goes off once, late by exactly the time away. Replayed on the
+trace's clock, so exactly means right between the title changes at 799 and 801 ms.
+*/
+static void enforcement_deadlines(bool reactor) {
+	std::string path = temp_path("enforcement.trace");
+	{
+		TraceWriter trace(path);
+		trace.write({TraceEvent::Type::new_active, std::chrono::microseconds(0), 1000, "/usr/bin/game", "level 1", 0});
+		trace.write({TraceEvent::Type::user_idle, std::chrono::milliseconds(100), 0, "", "", 0});
+		trace.write({TraceEvent::Type::user_active, std::chrono::milliseconds(600), 0, "", "", 0});
+		trace.write({TraceEvent::Type::new_title, std::chrono::milliseconds(799), 1000, "/usr/bin/game", "level 2", 0});
+		trace.write({TraceEvent::Type::new_title, std::chrono::milliseconds(801), 1000, "/usr/bin/game", "level 3", 0});
+		trace.write({TraceEvent::Type::no_active, std::chrono::milliseconds(1000), 0, "", "", 0});
+	}
+	std::ostringstream out;
+	Statistics stat(out);
+	WindowWatcher ww(stat, {path, ReplaySource::Speed::simulated});
+	ProgramClassifier::rules rules;
+	rules.emplace_back(new ProgramPathSet(ProgramRole::black, {"/usr/bin/game"}));
+	ww.set_rules(std::move(rules));
+	ww.set_enforcement(std::chrono::milliseconds(300), std::chrono::steady_clock::duration::zero());
+	std::vector<uint64_t> alarms; // events handled when it went off, its own included
+	ww.on_alarm([&alarms, &ww](seat_id, const ForeignWindow & wnd) {
+		expect(wnd.get_program_path() == "/usr/bin/game", "the alarm went off for " + wnd.get_program_path());
+		alarms.push_back(ww.counters().events);
+	});
+	if (reactor) {
+		Reactor r;
+		ww.run(r);
+	} else {
+		ww.run();
+	}
+	remove(path.c_str());
+	expect(alarms.size() == 1, std::to_string(alarms.size()) + " alarms instead of 1");
+	expect(alarms[0] == 5, "the alarm went off after " + std::to_string(alarms[0] - 1) + " events of the trace instead of 4");
+}
+
+static const struct {
+	const char * name;
+	std::function<void()> run;
+} checks[] = {
+	{"ProcessKiller/outcomes", killer_outcomes},
+	{"Reactor/cancel_due", reactor_cancel_due},
+	{"spsc_queue/wait_empty", queue_wait_empty},
+	{"RollupStore/midnight", rollup_midnight},
+	{"Statistics/midnight", statistics_midnight},
+	{"UsageLog/disorder", usage_log_disorder},
+	{"UsageLog/v1", usage_log_v1},
+	{"UsageLog/watermark", usage_log_watermark},
+	{"WindowWatcher/allocations", steady_state_allocations},
+	{"WindowWatcher/enforcement", std::bind(enforcement_deadlines, false)},
+	{"WindowWatcher/enforcement_reactor", std::bind(enforcement_deadlines, true)},
+	{"WindowWatcher/title_debounce_cap", title_debounce_cap},
+};
+
+int main(int argc, char ** argv) {
+	std::string filter = argc > 1 ? argv[1] : "";
+	int ret = 0;
+	for (const auto & check : checks) {
+		if (std::string(check.name).find(filter) == std::string::npos) continue;
+		try {
+			check.run();
+			std::cout << "ok   " << check.name << std::endl;
+		} catch (std::exception & e) {
+			std::cout << "FAIL " << check.name << ": " << e.what() << std::endl;
+			ret = 1;
+		}
+	}
+	return ret;
+}
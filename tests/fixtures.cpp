@@ -0,0 +1,17 @@
+#include "fixtures.hpp"
+#include "trace.hpp"
+#include <vector>
+
+void write_cycling_trace(const std::string & path, uint64_t events) {
+	std::vector<std::string> programs, titles;
+	for (int i = 0; i < 16; i++) programs.push_back("/usr/bin/program" + std::to_string(i));
+	// too long for the small string optimization, so that copying one would allocate
+	for (int i = 0; i < 256; i++) titles.push_back("a window title, number " + std::to_string(i * 7919));
+	TraceWriter trace(path);
+	for (uint64_t i = 0; i < events; i++) {
+		TraceEvent::Type type = i % 50 == 49 ? TraceEvent::Type::no_active
+			: i % 10 == 0 ? TraceEvent::Type::new_active : TraceEvent::Type::new_title;
+		size_t program = (i / 10) % programs.size();
+		trace.write({type, std::chrono::microseconds(i * 1000), uint32_t(1000 + program), programs[program], titles[i * 7919 % titles.size()], 0});
+	}
+}
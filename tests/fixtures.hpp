@@ -0,0 +1,22 @@
+#pragma once
+#include <string>
+#include <streambuf>
+#include <cstdint>
+
+/*
+What the checks (tests/checks.cpp) and the benchmarks (bench/microbench.cpp) both
+feed to the code they look at.
+*/
+
+/*
+Writes a trace that switches windows between 16 programs now and then, with a lot of
+title changes in between, an event every millisecond; it repeats itself every
+cycling_trace_period events.
+*/
+const uint64_t cycling_trace_period = 6400;
+void write_cycling_trace(const std::string & path, uint64_t events);
+
+// swallows whatever's written to it; a string stream would allocate as it grows
+struct null_buf : public std::streambuf {
+	int overflow(int c) override { return c; }
+};